@@ -10,12 +10,19 @@
 #include "Config.h"
 #include "ControlPanel.h"
 #include "WebServer.h"
+#include "Scheduler.h"
+#include "IsrStats.h"
+#include "KeyShaping.h"
+#include "Monitor.h"
+#include "KeyedAdc.h"
+#include "DataLog.h"
 
 // These need to be included for the libraries to be compiled in - Arduino specific
 #include <OneWire.h>
 #include <DallasTemperature.h>
 #include <SPI.h>
 #include <SD.h>
+#include <EEPROM.h>
 #include <TimeLib.h>
 #include <Ethernet.h>
 
@@ -35,7 +42,14 @@
 
 Beacon beacons[BEACON_COUNT];
 
+#if OUTPUT_SHIFT_REGISTERS
+// Beacon i uses outputs 4i to 4i+3 of the shift register chain (normal/inverted/PM0/PM1), see BeaconOutput.h
+static_assert(BEACON_COUNT * 4 <= OUTPUT_SHIFT_REGISTERS * 8, "not enough shift registers for the beacons");
+#define BEACON_PIN(i, p) OUTPUT_SHIFT(4 * (i) + (p))
+#else
 // IO pins used by the beacons (normal/inverted/PM0/PM1)
+// These are resolved to ports at startup, see outputAttachPin()
+// Pins 50-53 are the SPI bus of the Mega, shared by the ethernet and SD card.
 const byte beaconPins[BEACON_COUNT][4] = 
 {
   {9,8,7,6},
@@ -46,11 +60,28 @@ const byte beaconPins[BEACON_COUNT][4] =
   {38,39,40,41},
   {42,43,44,45},
   {46,47,48,49},
-  {50,51,52,52}
+  {14,15,16,17}
 };
+#define BEACON_PIN(i, p) beaconPins[i][p]
+#endif
 
-byte beaconMessages[BEACON_COUNT][BEACON_MESSAGE_LENGTH];
-char textBuffer[BEACON_MESSAGE_LENGTH];
+// PWM pins that follow the keying of the first beacons with a smooth envelope, 0 for hard keying only.
+// Only the pins of Timer3, 4 and 5 can do this: 2, 3, 5, 6, 7, 8, 44, 45 and 46, see KeyShaping.h
+const byte beaconShapingPins[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// Inputs that listen to what the first beacons really send: a digital pin that is high during a mark,
+// MONITOR_ANALOG(channel) for an RF detector, or MONITOR_NONE. The decoded text is checked, see /monitor.txt
+const byte beaconMonitorInputs[] =
+{
+  MONITOR_NONE, MONITOR_NONE, MONITOR_NONE, MONITOR_NONE, MONITOR_NONE, MONITOR_NONE, MONITOR_NONE, MONITOR_NONE, MONITOR_NONE
+};
+
+// Analog channels of the forward and reflected power detectors of the first beacons, sampled at every key down
+// and key up, see /power.txt. KEYED_ADC_NONE for none. Not shared with the analog sensors that are sent.
+const byte beaconPowerInputs[][2] =
+{
+  {KEYED_ADC_NONE, KEYED_ADC_NONE}
+};
 
 time_t last_log=0;
 
@@ -66,6 +97,21 @@ void processSyncMessage()
     if( pctime >= DEFAULT_TIME)  // check the integer is a valid time (greater than Jan 1 2013)
     {
       setTime(pctime); // Sync Arduino clock to the time received on the serial port
+      // Restart the beacon timer, so the beacon clock ticks in phase with the seconds of now()
+      cli();
+      beaconClockSet(pctime);
+      sei();
+      last_log=pctime;
+      Serial.print("Date: ");
+      Serial.print(year());
+      Serial.print("-");
+      Serial.print(month());
+      Serial.print("-");
+      Serial.print(day());
+      Serial.print(" ");
+      Serial.print(hour());
+      Serial.print(":");
+      Serial.println(minute());
     }
   }
 }
@@ -73,99 +119,88 @@ void processSyncMessage()
 void setup()
 {
   Serial.begin(9600);
-  WebServerInit();
-  controlPanelInit();
-  sensorsInit();
   for(int i=0; i<BEACON_COUNT; i++)
   {
-    beacons[i].begin(beaconPins[i][0], beaconPins[i][1], beaconPins[i][2], beaconPins[i][3]);
-    textBuffer[0] = 0;
-    getBeaconMessage(i, BEACON_DEFMSG, textBuffer, BEACON_MESSAGE_LENGTH);
-    if(morseEncodeMessage(beaconMessages[i], textBuffer, BEACON_MESSAGE_LENGTH)==false)
+    beacons[i].begin(BEACON_PIN(i, 0), BEACON_PIN(i, 1), BEACON_PIN(i, 2), BEACON_PIN(i, 3));
+  }
+  // Start keying from the EEPROM snapshot right away, the rest comes up while the beacons run
+  controlPanelRestore();
+  for(int i=0; (i<BEACON_COUNT) && (i<(int)sizeof(beaconShapingPins)); i++)
+  {
+    if(beaconShapingPins[i] && !beacons[i].shapeKeying(beaconShapingPins[i]))
     {
-      Serial.print(F("Error parsing text for beacon nr "));
-      Serial.print(i);
-      Serial.println(":");
-      Serial.println(morseGetError());
-      while(true)
-      {
-        // General strike! We demand better code!
-      }
+      Serial.print(F("Pin "));
+      Serial.print(beaconShapingPins[i]);
+      Serial.println(F(" can not be used for shaped keying"));
     }
-    beacons[i].setNextMessage(beaconMessages[i]);
   }
-  
-  // Wait until the time is synchronized
-  Serial.println("Enter the time (format: T<number> where <number> is the unix time)");
-  while(!Serial.available()) {}
-  processSyncMessage();
-  last_log=now();
-  Serial.print("Date: ");
-  Serial.print(year());
-  Serial.print("-");
-  Serial.print(month());
-  Serial.print("-");
-  Serial.print(day());
-  Serial.print(" ");
-  Serial.print(hour());
-  Serial.print(":");
-  Serial.println(minute());
-  
-  // TODO: For debugging only!!
-    SD.remove("/log/2016/05/25.CSV");
+  for(int i=0; (i<BEACON_COUNT) && (i<(int)(sizeof(beaconPowerInputs)/sizeof(beaconPowerInputs[0]))); i++)
+  {
+    if(beaconPowerInputs[i][0] != KEYED_ADC_NONE)
+    {
+      beacons[i].samplePower(keyedAdcAttach(i, beaconPowerInputs[i][0], beaconPowerInputs[i][1]));
+    }
+  }
+  schedulerInit();
+#ifdef ENABLE_ISR_STATS
+  isrStatsReset();
+#endif
   
   // Setup TIMER 1 hardware directly
   cli();//stop interrupts
 
-  //set timer1 interrupt at 10Hz
+  //set timer1 interrupt at BEACON_TICK_RATE
   TCCR1A = 0;// set entire TCCR1A register to 0
   TCCR1B = 0;// same for TCCR1B
   TCNT1  = 0;//initialize counter value to 0
-  // set compare match register for 1hz increments
-  OCR1A = 1562;// = (16*10^6) / (10*1024) - 1 (must be <65536)
-  // turn on CTC mode
-  TCCR1B |= (1 << WGM12);
-  // Set CS12 and CS10 bits for 1024 prescaler
-  TCCR1B |= (1 << CS12) | (1 << CS10);  
+  // The counter runs freely (normal mode), the interrupt moves the compare match to the next tick a beacon needs.
+  // TCNT1 - OCR1A is then the time since the tick was due, which tells how late the interrupt is.
+  OCR1A = BEACON_TIMER_PERIOD;// = (16*10^6) / (1000*64) = 250
+  // Set CS11 and CS10 bits for 64 prescaler
+  TCCR1B |= (1 << CS11) | (1 << CS10);  
   // enable timer compare interrupt
   TIMSK1 |= (1 << OCIE1A);
 
   sei();//allow interrupts
+
+  // The queues hold a few parts of the messages, controlPanelInit() refills them until loop() takes over
+  WebServerInit();
+  controlPanelInit();  // replaces the snapshot with the settings on the SD card
+  sensorsInit();
+  monitorInit();
+  for(int i=0; (i<BEACON_COUNT) && (i<(int)sizeof(beaconMonitorInputs)); i++)
+  {
+    monitorAttach(i, beaconMonitorInputs[i]);
+  }
+
+  // The time is set whenever it arrives, see loop(). No logging before that.
+  Serial.println("Enter the time (format: T<number> where <number> is the unix time)");
+  
+  // TODO: For debugging only!!
+    SD.remove("/log/2016/05/25.CSV");
 }
 
 // Interrupt routine for TIMER 1
-// Run the beacons
 ISR(TIMER1_COMPA_vect)
 {
-  for(int i=0; i<BEACON_COUNT; i++)
-  {
-    beacons[i].tick();
-  }
+  beaconInterrupt();
+}
+
+// Steps the shaped keying envelopes, only enabled while one is rising or falling
+ISR(TIMER3_OVF_vect)
+{
+  shapingInterrupt();
+}
+
+// Power detector sample, started by the Timer1 compare match B after a key change
+ISR(ADC_vect)
+{
+  keyedAdcInterrupt();
 }
 
 void loop()
 {
-  for(int i=0; i<BEACON_COUNT; i++)
-  {
-    if(beacons[i].isDone())
-    {
-      getCurrentMessage(i, textBuffer, BEACON_MESSAGE_LENGTH);
-      if(morseEncodeMessage(beaconMessages[i], textBuffer, BEACON_MESSAGE_LENGTH)==false)
-      {
-        Serial.print(F("Error parsing text for beacon nr "));
-        Serial.print(i);
-        Serial.println(":");
-        Serial.println(morseGetError());
-        while(true)
-        {
-          // General strike! We demand better code!
-        }
-      }
-      cli();
-      beacons[i].setNextMessage(beaconMessages[i]);
-      sei();
-    }
-  }
+  schedulerTick();
   sensorsTick();
   WebServerTick();
   if(Serial.available())
@@ -173,10 +208,14 @@ void loop()
     processSyncMessage();
   }
   time_t t=now();
-  if((t-last_log) > LOG_INTERVAL)
+  if(timeStatus() != timeNotSet)
   {
-    writeLog(t);
-    last_log += LOG_INTERVAL; // prevent drifting of the logging times
+    if((t-last_log) > LOG_INTERVAL)
+    {
+      writeLog(t);
+      last_log += LOG_INTERVAL; // prevent drifting of the logging times
+    }
+    dataLogTick(t);
   }
-  delay(20);
+  monitorIdle(20);
 }
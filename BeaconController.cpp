@@ -1,5 +1,6 @@
 #include "BeaconController.h"
 #include "Sensors.h"
+#include "IsrStats.h"
 #include <avr/pgmspace.h>
 #include <assert.h>
 
@@ -7,24 +8,14 @@
 // There are multiple definitions about WPM speeds.
 // In this scope a standard word length is defined as having 50 dot lengths.
 // 12 WPM = 600 dots => 1 dot = 0.1s
+// A dot or a dash is followed by 1 dot of silence, a character by 3 and a word by 7 dots.
+// So a dot lasts 60s / (50 * WPM) = 6s / (5 * WPM), or (6 * BEACON_TICK_RATE) / (5 * WPM) ticks.
+#define DOT_TICKS_NUMERATOR    (6UL * BEACON_TICK_RATE)
+#define DOT_TICKS_DENOMINATOR(wpm) (5U * (wpm))
 
-static const byte morse_chars[] =
-{
-  0xF9, 0xE8, 0xEA, 0xF4, // A, B, C, D
-  0xFC, 0xE2, 0xF6, 0xE0, // E, F, G, H
-  0xF8, 0xE7, 0xF5, 0xE4, // I, J, K, L
-  0xFB, 0xFA, 0xF7, 0xE6, // M, N, O, P
-  0xED, 0xF2, 0xF0, 0xFD, // Q, R, S, T
-  0xF1, 0xE1, 0xF3, 0xE9, // U, V, W, X
-  0xEB, 0xEC                   // Y, Z
-};
-
-static const byte morse_digits[]=
-{ 
-  0xDF, 0xCF, 0xC7, 0xC3, // 0 1 2 3
-  0xC1, 0xC0, 0xD0, 0xD8, // 4 5 6 7
-  0xDC, 0xDE // 8 9
-};
+// Ticks to wait before looking at the queue and the wakeup flag again when idle, one pass of the main loop.
+// A message queued for an idle beacon then starts about as soon as the main loop could have queued it.
+#define IDLE_TICKS (BEACON_TICK_RATE / 50)
 
 // The morse characters are coded as follows:
 // Each letter is contained within 1 byte
@@ -40,66 +31,131 @@ static const byte morse_digits[]=
 // 0-3: set power mode
 // 0x10 + i  delay with CARRIER ON
 // 0x20 + i  delay with CARRIER OFF
+// 0x40 + i  value of sensor i (see Sensors.h), filled in at transmit time
+// 0x60 + k  followed by a byte n: send the next n characters or codes k times
+// 0x70 + k  send the whole message k times
 
 #define POWER_MODE(i)        (i)
 #define DELAY_CARRIER_ON(i)  (0x10 + (i))
 #define DELAY_CARRIER_OFF(i) (0x20 + (i))
+#define SENSOR_VALUE(i)      (0x40 + (i))
+#define MORSE_REPEAT(k)      (0x60 + (k))
+#define MORSE_LOOP(k)        (0x70 + (k))
 #define MORSE_SPACE           0x7E
-#define MORSE_END             0x7F
 
-#define MORSE_PARSE_ERROR_STRLEN 50
+// Dot lengths of the morse elements and gaps, in a compiled message
+#define DOT_LENGTH        1
+#define DASH_LENGTH       3
+#define ELEMENT_GAP       1
+#define CHARACTER_GAP     3
+#define WORD_GAP          7
+#define DELAY_LENGTH(i)   (16 * (i))
+
+// The first n elements of a pattern as bits, the last one in bit 0, 1 = dash. Used by morsePack().
+static constexpr byte morseBits(const char *pattern, byte n, byte bits)
+{
+  return n ? morseBits(pattern + 1, n - 1, (bits << 1) | (*pattern == '-')) : bits;
+}
+
+/*!
+ * Pack the elements of a character into its morse code, e.g. morsePack(".-.") for R
+ */
+template<size_t N> static constexpr byte morsePack(const char (&pattern)[N])
+{
+  static_assert((N >= 2) && (N <= 7), "a morse character has 1 to 6 elements");
+  return ((0xFF << N) & 0xFF) | morseBits(pattern, N - 1, 0);
+}
+
+// Morse code of every supported character, 0 for characters that can not be sent
+static constexpr byte morseCode(int c)
+{
+  return (c >= 'a') && (c <= 'z') ? morseCode(c - 'a' + 'A') :
+    c == 'A' ? morsePack(".-") :
+    c == 'B' ? morsePack("-...") :
+    c == 'C' ? morsePack("-.-.") :
+    c == 'D' ? morsePack("-..") :
+    c == 'E' ? morsePack(".") :
+    c == 'F' ? morsePack("..-.") :
+    c == 'G' ? morsePack("--.") :
+    c == 'H' ? morsePack("....") :
+    c == 'I' ? morsePack("..") :
+    c == 'J' ? morsePack(".---") :
+    c == 'K' ? morsePack("-.-") :
+    c == 'L' ? morsePack(".-..") :
+    c == 'M' ? morsePack("--") :
+    c == 'N' ? morsePack("-.") :
+    c == 'O' ? morsePack("---") :
+    c == 'P' ? morsePack(".--.") :
+    c == 'Q' ? morsePack("--.-") :
+    c == 'R' ? morsePack(".-.") :
+    c == 'S' ? morsePack("...") :
+    c == 'T' ? morsePack("-") :
+    c == 'U' ? morsePack("..-") :
+    c == 'V' ? morsePack("...-") :
+    c == 'W' ? morsePack(".--") :
+    c == 'X' ? morsePack("-..-") :
+    c == 'Y' ? morsePack("-.--") :
+    c == 'Z' ? morsePack("--..") :
+    c == '0' ? morsePack("-----") :
+    c == '1' ? morsePack(".----") :
+    c == '2' ? morsePack("..---") :
+    c == '3' ? morsePack("...--") :
+    c == '4' ? morsePack("....-") :
+    c == '5' ? morsePack(".....") :
+    c == '6' ? morsePack("-....") :
+    c == '7' ? morsePack("--...") :
+    c == '8' ? morsePack("---..") :
+    c == '9' ? morsePack("----.") :
+    c == '=' ? morsePack("-...-") :
+    c == '?' ? morsePack("..--..") :
+    c == '/' ? morsePack("-..-.") :
+    c == '.' ? morsePack(".-.-.-") :
+    c == ',' ? morsePack("--..--") :
+    c == '-' ? morsePack("-....-") :
+    c == '+' ? morsePack(".-.-.") :
+    c == ' ' ? MORSE_SPACE :
+    c == 0 ? MORSE_END :
+    0;
+}
+
+static_assert(morseCode('R') == 0xF2, "morse code packing");
+static_assert(morseCode('0') == 0xDF, "morse code packing");
+static_assert(morseCode('?') == 0x8C, "morse code packing");
+static_assert(morseCode('k') == morseCode('K'), "lower case letters");
+
+// Lookup table for morseEncodeChar(), indexed by character
+#define MORSE_CODES_4(c)   morseCode(c), morseCode((c) + 1), morseCode((c) + 2), morseCode((c) + 3)
+#define MORSE_CODES_16(c)  MORSE_CODES_4(c), MORSE_CODES_4((c) + 4), MORSE_CODES_4((c) + 8), MORSE_CODES_4((c) + 12)
+#define MORSE_CODES_64(c)  MORSE_CODES_16(c), MORSE_CODES_16((c) + 16), MORSE_CODES_16((c) + 32), MORSE_CODES_16((c) + 48)
+static const byte morseCodes[256] PROGMEM =
+{
+  MORSE_CODES_64(0), MORSE_CODES_64(64), MORSE_CODES_64(128), MORSE_CODES_64(192)
+};
+
+#define MORSE_PARSE_ERROR_STRLEN 80
 static char morseParseError[MORSE_PARSE_ERROR_STRLEN];
 
 
-/* Encode a single character to a morse-encoded byte
+/* Encode a single character to a morse-encoded byte, 0 if it can not be encoded
 */
 byte morseEncodeChar(char c)
 {
-  if((c>='0') && (c<='9'))
-  {
-    return morse_digits[c-'0'];
-  }
-  if((c>='a') && (c<='z'))
-  {
-    return morse_chars[c-'a'];
-  }
-  if((c>='A') && (c<='Z'))
-  {
-    return morse_chars[c-'A'];
-  }
-  switch(c)
-  {
-    case '=':  // -...-
-      return B11010001;
-    case '?':  // ..--..
-      return B10001100;
-    case '/':  // -..-.
-      return B11010010;
-    case '.':  // .-.-.-
-      return B10010101;
-    case ',':  // --..--
-      return B10110011;
-    case '-': // -....-
-      return B10100001;
-    case '+': // .-.-.
-      return B1001010;
-    case 0:
-      return MORSE_END;
-    case ' ':
-      return MORSE_SPACE;
-    default:
-      return 0;
-  }
+  return pgm_read_byte(&morseCodes[(byte)c]);
 }
 
 /*!
  * Encode an ASCII string to a encoded morse message, where each byte represents a morse character or a special "op code",
  * Special codes:
  *  $P0  ... $P3: Inserts a "Set power mode" code into the output.
- *  $A00 ... $A15: Inserts the current value of the analog channel into the message (at encoding time, not transmit time!)
- *  $T0 ... T7: Inserts the current temperature into the message (at encoding time)
+ *  $A00 ... $A15: Inserts the value of the analog channel into the message (at transmit time)
+ *  $T0 ... T7: Inserts the temperature into the message (at transmit time)
  *  $+1 ... $+9: insert delay with CARRIER ON
  *  $-1 ... $-9: insert delay with CARRIER OFF
+ *  $Rnk: send the next n (1-9) characters or codes k (2-9) times, e.g. "$R42VVV DE" sends "VVV VVV DE".
+ *        Repeats can not be nested. A repeat is sent as the same segments again, power mode included.
+ *  $Lk: send the whole message k (2-9) times. Only one per message.
+ * Repeats and loops are not expanded: after morseCompileMessage() the beacon goes back while transmitting,
+ * morseCompileNext() compiles their codes again.
  * If encoding fails, the error can be retreived as a human-readable string using morseGetError.
  *
  * \param codedMessage  the destination buffer
@@ -114,6 +170,8 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
 {
   morseParseError[0] = 0;
   int outPos = 0;
+  int repeatItems = 0;  // characters and codes left in the current repeat
+  boolean loop = false;
   assert(maxBytes>0);
   if(maxBytes>0)
   {
@@ -126,6 +184,7 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
   }
   for(int i = 0; str[i]; i++)
   {
+    boolean item = true;  // the code counts for a repeat
     /* Special code */
     if(str[i]=='$')
     {
@@ -138,7 +197,7 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
         i++;
         if( (str[i]>='0') && (str[i]<='3') )
         {
-          if(outPos>maxBytes)
+          if(outPos>=maxBytes)
           {
             sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
             codedMessage[0] = MORSE_END;
@@ -181,28 +240,19 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
           codedMessage[0] = MORSE_END;
           return false;
         }
-        // We parsed the channel nr. Check for worst case string size.
-        if((outPos+maxAnalogStrSize(channel))>maxBytes)
+        if(channel >= NUM_ANALOG_CHANNELS)
         {
-          sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
+          sprintf_P(morseParseError, PSTR("Error parsing analog channel number at position %d (expecting 00-15)"), i);
           codedMessage[0] = MORSE_END;
           return false;
         }
-        // Read the sensor and place the string in the codedMessage buffer directly, then encode it in-place
-        // We know that we have enough space for it because we checked it with maxAnalogStrSize.
-        //Casting a byte* to a char* - No problem here
-        readAnalogSensor((char*)(&codedMessage[outPos]), channel);
-        while(codedMessage[outPos])
+        if(outPos>=maxBytes)
         {
-          char c = morseEncodeChar(codedMessage[outPos]);
-          if(c == 0)
-          {
-            sprintf_P(morseParseError, PSTR("Can not encode character '%c' at position %d"), codedMessage[outPos], i);
-            codedMessage[0] = MORSE_END;
-            return false;
-          }
-          codedMessage[outPos++]=c;
+          sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
+          codedMessage[0] = MORSE_END;
+          return false;
         }
+        codedMessage[outPos++] = SENSOR_VALUE(SENSOR_ANALOG(channel));
       }
       /******************************************************\
       |* Parsing an "insert temperature" code ($T0 ... $T7) *|
@@ -222,26 +272,13 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
           return false;
         }
         
-        // We parsed the channel number. Check worst case size
-        if((outPos+maxTemperatureStrSize(channel))>maxBytes)
+        if(outPos>=maxBytes)
         {
           sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
           codedMessage[0] = MORSE_END;
           return false;
         }
-        // Casting byte* to char* - No problem here
-        readTemperatureSensor((char*)(&codedMessage[outPos]), channel);
-        while(codedMessage[outPos])
-        {
-          char c = morseEncodeChar(codedMessage[outPos]);
-          if(c == 0)
-          {
-            sprintf_P(morseParseError, PSTR("Can not encode character '%c' at position %d"), codedMessage[outPos], i);
-            codedMessage[0] = MORSE_END;
-            return false;
-          }
-          codedMessage[outPos++]=c;
-        }
+        codedMessage[outPos++] = SENSOR_VALUE(SENSOR_TEMPERATURE(channel));
       }
       /****************************************************************\
       |* Parsing an "insert delay with CARRIER ON" code ($+1 ... $+9) *|
@@ -251,7 +288,7 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
         i++;
         if((str[i]>='1') && (str[i]<='9'))
         {
-          if(outPos>maxBytes)
+          if(outPos>=maxBytes)
           {
             sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
             codedMessage[0] = MORSE_END;
@@ -274,7 +311,7 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
         i++;
         if((str[i]>='1') && (str[i]<='9'))
         {
-          if(outPos>maxBytes)
+          if(outPos>=maxBytes)
           {
             sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
             codedMessage[0] = MORSE_END;
@@ -289,9 +326,67 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
           return false;
         }
       }
+      /*******************************************\
+      |* Parsing a "repeat" code ($R12 ... $R99) *|
+      \*******************************************/
+      else if(str[i]=='R')
+      {
+        if(repeatItems)
+        {
+          sprintf_P(morseParseError, PSTR("Repeat inside a repeat at position %d"), i);
+          codedMessage[0] = MORSE_END;
+          return false;
+        }
+        i++;
+        if((str[i]<'1') || (str[i]>'9') || (str[i+1]<'2') || (str[i+1]>'9'))
+        {
+          sprintf_P(morseParseError, PSTR("Error parsing repeat at position %d (expecting 1-9 codes, 2-9 times)"), i);
+          codedMessage[0] = MORSE_END;
+          return false;
+        }
+        if(outPos+1>=maxBytes)
+        {
+          sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
+          codedMessage[0] = MORSE_END;
+          return false;
+        }
+        repeatItems = str[i]-'0';
+        codedMessage[outPos++] = MORSE_REPEAT(str[i+1]-'0');
+        codedMessage[outPos++] = repeatItems;
+        i++;
+        item = false;
+      }
+      /***************************************\
+      |* Parsing a "loop" code ($L2 ... $L9) *|
+      \***************************************/
+      else if(str[i]=='L')
+      {
+        i++;
+        if(loop)
+        {
+          sprintf_P(morseParseError, PSTR("Second loop at position %d"), i);
+          codedMessage[0] = MORSE_END;
+          return false;
+        }
+        if((str[i]<'2') || (str[i]>'9'))
+        {
+          sprintf_P(morseParseError, PSTR("Error parsing loop at position %d (expecting 2-9)"), i);
+          codedMessage[0] = MORSE_END;
+          return false;
+        }
+        if(outPos>=maxBytes)
+        {
+          sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
+          codedMessage[0] = MORSE_END;
+          return false;
+        }
+        codedMessage[outPos++] = MORSE_LOOP(str[i]-'0');
+        loop = true;
+        item = false;
+      }
       else
       {
-        sprintf_P(morseParseError, PSTR("Error parsing special code at position %d (expecting P, A, T, + or -)"), i);
+        sprintf_P(morseParseError, PSTR("Unknown special code at position %d (expecting P, A, T, +, -, R or L)"), i);
         codedMessage[0] = MORSE_END;
         return false;
       }
@@ -308,7 +403,7 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
       }
       else
       {
-        if(outPos>maxBytes)
+        if(outPos>=maxBytes)
         {
           sprintf_P(morseParseError, PSTR("output buffer too small (max. %d bytes)"), maxBytes);
           codedMessage[0] = MORSE_END;
@@ -317,261 +412,1299 @@ boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes)
         codedMessage[outPos++]=c;
       }
     }
+    if(item && repeatItems)
+    {
+      repeatItems--;
+    }
   }
   codedMessage[outPos] = MORSE_END;
   return true;
 }
 
-/*!
- * Returns a human-readable string detailing the last error while parsing a morse string (if any)
- * /returns a human-readable error message or "" if there was no error.
- * /sa morseEncodeMessage()
- */
-const char* morseGetError()
+// Collects runs of equal output state while compiling a message
+struct SegmentWriter
 {
-  return morseParseError;
+  byte *segments;
+  int maxSegments;   // not counting the SEGMENT_END
+  int pos;
+  byte state;        // output state and power mode of the pending run
+  unsigned length;   // length of the pending run in dots
+  byte implicitGap;  // dots of the pending run already sent by the beacon (after a sensor value)
+  boolean full;      // failed for lack of room, not because of the message
+};
+
+static boolean segmentFull(SegmentWriter &w)
+{
+  sprintf_P(morseParseError, PSTR("segment buffer too small (max. %d segments)"), w.maxSegments);
+  w.full = true;
+  return false;
 }
 
-void debugPrintMorse(const char *msg)
+// Write the pending run. If there is not enough room, as much of it as fits is written.
+static boolean segmentFlush(SegmentWriter &w)
 {
-  for(int i = 0; msg[i]!=MORSE_END; i++)
+  while(w.length)
   {
-    Serial.println((byte)(msg[i]), BIN);
+    byte len = (w.length > SEGMENT_MAX_LENGTH) ? SEGMENT_MAX_LENGTH : w.length;
+    if(w.pos >= w.maxSegments)
+    {
+      return segmentFull(w);
+    }
+    w.segments[w.pos++] = w.state | (len - 1);
+    w.length -= len;
   }
-  Serial.println(F("---END OF MESSAGE---"));
+  return true;
 }
 
-/********************************************************************************************************\
-|***                                                                                                  ***|
-|***                                         Beacon Class                                             ***|
-|***                                                                                                  ***|
-\********************************************************************************************************/
-
-
-void Beacon::keyOn()
+static boolean segmentAppend(SegmentWriter &w, byte state, unsigned length)
 {
-  digitalWrite(normalPin, 1);
-  digitalWrite(invPin, 0);
-}
-void Beacon::keyOff()
-{
-  digitalWrite(normalPin, 0);
-  digitalWrite(invPin, 1);
-//debug    noTone(invPin);
-}
-void Beacon::carrierOff()
-{
-  digitalWrite(normalPin, 0);
-  digitalWrite(invPin, 0);
+  if(state != w.state)
+  {
+    if(!segmentFlush(w))
+    {
+      return false;
+    }
+    w.state = state;
+    w.implicitGap = 0;
+  }
+  w.length += length;
+  return true;
 }
 
-void Beacon::powerMode(byte mode)
+// Write a control segment and its argument. The pending run is flushed, and counts as
+// already sent for the gap that follows.
+static boolean segmentControl(SegmentWriter &w, byte control, byte argument, byte size)
 {
-  digitalWrite(modePin0, mode & 1);
-  digitalWrite(modePin1, mode & 2);
+  unsigned gap = w.implicitGap + w.length;
+  if(!segmentFlush(w))
+  {
+    return false;
+  }
+  if(w.pos + size > w.maxSegments)
+  {
+    return segmentFull(w);
+  }
+  w.segments[w.pos++] = control;
+  if(size > 1)
+  {
+    w.segments[w.pos++] = argument;
+  }
+  w.implicitGap = (gap > WORD_GAP) ? WORD_GAP : gap;
+  return true;
 }
 
-Beacon::Beacon(int normalPin, int invPin, int modePin0, int modePin1)
-{
-  begin(normalPin, invPin, modePin0, modePin1);
-}
-Beacon::Beacon()
+// Compile a character or a code that is sent as it is, everything but repeats and loops
+static boolean compileCode(SegmentWriter &w, const byte *codedMessage, int i, byte *mode)
 {
-  end();
+  byte code = codedMessage[i];
+  boolean ok = true;
+  if(code & 0x80)
+  {
+    // Remove filler and the 0 that follows it, what remains are the elements
+    byte elements = 7;
+    while(code & 0x80)
+    {
+      code <<= 1;
+      elements--;
+    }
+    code <<= 1;
+    if(elements > 6)
+    {
+      sprintf_P(morseParseError, PSTR("Invalid morse character 0x%02x at position %d"), codedMessage[i], i);
+      return false;
+    }
+    while(ok && elements)
+    {
+      elements--;
+      ok = segmentAppend(w, SEGMENT_KEY_ON | (*mode << 4), (code & 0x80) ? DASH_LENGTH : DOT_LENGTH);
+      ok = ok && segmentAppend(w, SEGMENT_KEY_OFF | (*mode << 4), elements ? ELEMENT_GAP : CHARACTER_GAP);
+      code <<= 1;
+    }
+  }
+  else if(code == MORSE_SPACE)
+  {
+    // The character gap is already there
+    ok = segmentAppend(w, SEGMENT_KEY_OFF | (*mode << 4), WORD_GAP - CHARACTER_GAP);
+  }
+  else if(code <= POWER_MODE(3))
+  {
+    *mode = code;
+  }
+  else if((code >= DELAY_CARRIER_ON(1)) && (code <= DELAY_CARRIER_ON(9)))
+  {
+    ok = segmentAppend(w, SEGMENT_KEY_ON | (*mode << 4), DELAY_LENGTH(code - DELAY_CARRIER_ON(0)));
+  }
+  else if((code >= DELAY_CARRIER_OFF(1)) && (code <= DELAY_CARRIER_OFF(9)))
+  {
+    ok = segmentAppend(w, SEGMENT_KEY_OFF | (*mode << 4), DELAY_LENGTH(code - DELAY_CARRIER_OFF(0)));
+  }
+  else if((code >= SENSOR_VALUE(0)) && (code < SENSOR_VALUE(SENSOR_COUNT)))
+  {
+    // Filled in by the beacon while transmitting. The value ends with a character gap.
+    ok = segmentFlush(w);
+    if(ok && (w.pos + 2 > w.maxSegments))
+    {
+      ok = segmentFull(w);
+    }
+    if(ok)
+    {
+      w.segments[w.pos++] = SEGMENT_SENSOR(*mode);
+      w.segments[w.pos++] = code - SENSOR_VALUE(0);
+      w.state = SEGMENT_KEY_OFF | (*mode << 4);
+      w.implicitGap = CHARACTER_GAP;
+    }
+  }
+  else
+  {
+    sprintf_P(morseParseError, PSTR("Unknown code 0x%02x at position %d"), code, i);
+    ok = false;
+  }
+  return ok;
 }
-void Beacon::begin(int normalPin, int invPin, int modePin0, int modePin1)
+
+// Separate a message from the next one by at least a word gap
+static boolean compileEnd(SegmentWriter &w, byte mode)
 {
-  this->normalPin = normalPin;
-  this->invPin = invPin;
-  this->modePin0 = modePin0;
-  this->modePin1 = modePin1;
-  done = true;
-  enabled = true;
-  nextMsg = 0;
-  pinMode(normalPin, OUTPUT);
-  pinMode(invPin, OUTPUT);
-  pinMode(modePin0, OUTPUT);
-  pinMode(modePin1, OUTPUT);
-  carrierOff();
-  powerMode(0);
+  if((w.state & SEGMENT_STATE_MASK) != SEGMENT_KEY_OFF)
+  {
+    return segmentAppend(w, SEGMENT_KEY_OFF | (mode << 4), WORD_GAP);
+  }
+  if(w.length + w.implicitGap < WORD_GAP)
+  {
+    w.length = WORD_GAP - w.implicitGap;
+  }
+  return true;
 }
 
-void Beacon::end()
+/*!
+ * Compile an encoded morse message into timing segments, so the Beacon class does not need to
+ * decode the message bit by bit while transmitting.
+ * Every character is followed by a character gap, and the message is followed by a word gap,
+ * so messages can be sent back to back.
+ * If compiling fails, the error can be retreived as a human-readable string using morseGetError.
+ *
+ * \param segments      the destination buffer
+ * \param codedMessage  the message, as encoded by morseEncodeMessage
+ * \param maxSegments   the size of the destination buffer. Should be at least 1 so the SEGMENT_END can be written
+ *
+ * \return true on success, false if compiling fails
+ *
+ * \sa morseEncodeMessage(), morseGetError()
+ */
+boolean morseCompileMessage(byte *segments, const byte *codedMessage, int maxSegments)
 {
-  setEnabled(false);
-  normalPin = invPin = modePin0 = modePin1 = -1;
-  done = true;
-  nextMsg = 0;
+  byte mode = 0;
+  return morseCompilePart(segments, codedMessage, maxSegments, &mode, true);
 }
 
-void Beacon::tick()
+/*!
+ * Compile one part of a message that is sent in several parts, see morseCompileMessage().
+ * Only the last part is followed by a word gap.
+ *
+ * \param segments      the destination buffer
+ * \param codedMessage  the part, as encoded by morseEncodeMessage
+ * \param maxSegments   the size of the destination buffer
+ * \param modeInOut     power mode at the start of the part, receives the power mode at its end.
+ *                      Start the first part at 0.
+ * \param last          true for the last part of the message
+ *
+ * \return true on success, false if compiling fails
+ */
+boolean morseCompilePart(byte *segments, const byte *codedMessage, int maxSegments, byte *modeInOut, boolean last)
 {
-  if(!enabled)
+  SegmentWriter w;
+  byte mode = *modeInOut;
+
+  morseParseError[0] = 0;
+  assert(maxSegments>0);
+  if(maxSegments<=0)
   {
-    return;
+    strcpy_P(morseParseError, PSTR("segment buffer has size 0"));
+    return false;
   }
-  if(done)
+  w.segments = segments;
+  w.maxSegments = maxSegments - 1; // We will always need a SEGMENT_END
+  w.pos = 0;
+  w.state = SEGMENT_CARRIER_OFF;
+  w.length = 0;
+  w.implicitGap = 0;
+  w.full = false;
+  segments[0] = SEGMENT_END;
+
+  // A loop goes back to the start of the message, so it goes first wherever it was in the text
+  for(int i = 0; codedMessage[i] != MORSE_END; i++)
   {
-    if(nextMsg)
+    if((codedMessage[i] >= MORSE_REPEAT(2)) && (codedMessage[i] <= MORSE_REPEAT(9)))
+    {
+      i++;
+    }
+    else if((codedMessage[i] >= MORSE_LOOP(2)) && (codedMessage[i] <= MORSE_LOOP(9)) &&
+            !segmentControl(w, SEGMENT_LOOP, codedMessage[i] - MORSE_LOOP(0), 2))
     {
-      msg = nextMsg;
-      nextMsg = 0;
-      msgPos = 0;
-      bitPos = 7;
-      done = false;
+      segments[0] = SEGMENT_END;
+      return false;
     }
   }
-  else
+
+  byte repeatItems = 0;  // characters and codes left in the current repeat
+  for(int i = 0; codedMessage[i] != MORSE_END; i++)
   {
-    if(bitPos==7)
+    byte code = codedMessage[i];
+    boolean ok = true;
+    boolean item = true;
+    if((code >= MORSE_REPEAT(2)) && (code <= MORSE_REPEAT(9)) && !repeatItems)
     {
-      // Interpret next byte
-      code = msg[msgPos];
-      if((code & 0x80) == 0)
+      i++;
+      repeatItems = codedMessage[i];
+      if((repeatItems == 0) || (repeatItems == MORSE_END))
       {
-        if(code == MORSE_END)
-        {
-          carrierOff();
-          done = true;
-          bitPos=0;
-        }
-        else if(code == MORSE_SPACE)
-        {
-          keyOff();
-          offPause=5;
-          bitPos=0;
-        }
-        else if(code<4)
-        {
-          powerMode(code);
-          msgPos++;
-        }
-        else if(code & 0x10)
-        {
-          keyOn();
-          cmdPause = 16 * (code & 0xEF);
-          bitPos=0;
-        }
-        else if(code & 0x20)
-        {
-          keyOff();
-          cmdPause = 16 * (code & 0xDF);
-          bitPos=0;
-        }
-        else
-        {
-          // unknown code?????? Set to done
-          done = true;
-        }
+        sprintf_P(morseParseError, PSTR("Invalid repeat at position %d"), i - 1);
+        ok = false;
       }
       else
       {
-        // Remove filler
-        while(code & 0x80)
-        {
-          code <<= 1;
-          bitPos--;
-        }
-        code <<= 1;
-        bitPos--;
-        
-        // Start transmitting first sign
-        keyOn();
-        if(code & 0x80)
-        {
-          onPause = 3;
-        }
-        else
-        {
-          onPause = 1;
-        }
+        ok = segmentControl(w, SEGMENT_REPEAT, code - MORSE_REPEAT(0), 2);
       }
+      item = false;
+    }
+    else if((code >= MORSE_LOOP(2)) && (code <= MORSE_LOOP(9)))
+    {
+      // Already done
+      item = false;
     }
     else
     {
-      // It wasn't the begin of a byte
-      if(cmdPause)
-      {
-        cmdPause--;
-        if(cmdPause==0)
-        {
-          msgPos++;
-          bitPos=7;
-        }
-      }
-      else if(onPause)
-      {
-        onPause--;
-        if(onPause==0)
-        {
-          keyOff();
-          if(bitPos==0)
-          {
-            offPause=3;
-          }
-          else
-          {
-            offPause=1;
-          }
-        }
-      }
-      else if(offPause)
+      ok = compileCode(w, codedMessage, i, &mode);
+    }
+    if(ok && item && repeatItems)
+    {
+      repeatItems--;
+      if(repeatItems == 0)
       {
-        offPause--;
-        if(offPause==0)
-        {
-          if(bitPos)
-          {
-            code <<= 1;
-            bitPos--;
-            keyOn();
-            if(code & 0x80)
-            {
-              onPause=3;
-            }
-            else
-            {
-              onPause = 1;
-            }
-          }
-          else
-          {
-            // Proceed to next byte
-            msgPos++;
-            bitPos = 7;
-          }
-        }
+        ok = segmentControl(w, SEGMENT_REPEAT_END, 0, 1);
       }
     }
+    if(!ok)
+    {
+      segments[0] = SEGMENT_END;
+      return false;
+    }
+  }
+  // A repeat that runs past the end, as in a part of a streamed message, ends with it
+  if(repeatItems && !segmentControl(w, SEGMENT_REPEAT_END, 0, 1))
+  {
+    segments[0] = SEGMENT_END;
+    return false;
+  }
+  *modeInOut = mode;
+  if(last && (w.pos || w.length) && !compileEnd(w, mode))
+  {
+    segments[0] = SEGMENT_END;
+    return false;
+  }
+  if(!segmentFlush(w))
+  {
+    segments[0] = SEGMENT_END;
+    return false;
   }
+  segments[w.pos] = SEGMENT_END;
+  return true;
 }
 
-boolean Beacon::isDone()
+// A character or code did not fit, it goes in the next part. A part that is still empty gets as much of
+// the pending run as fits, so every part takes the message further.
+// Returns false if compiling failed for another reason, or the character does not fit in a part at all.
+static boolean partFull(SegmentWriter &w, const SegmentWriter &before)
 {
-  return (enabled==false) || (done && (nextMsg==0));
+  if(!w.full)
+  {
+    return false;
+  }
+  w = before;
+  if(w.pos == 0)
+  {
+    segmentFlush(w);
+    return w.pos > 0;
+  }
+  return true;
 }
 
-void Beacon::setNextMessage(byte *codedMessage)
+/*!
+ * Start compiling a message a part at a time, see morseCompileNext().
+ *
+ * \param c             the state of the compiler
+ * \param codedMessage  the message, as encoded by morseEncodeMessage. It must stay as it is until the last part.
+ * \param mode          power mode at the start of the message
+ * \param last          false if the message is a part of a longer one: it does not end with a word gap
+ */
+void morseCompileStart(MorseCompiler &c, const byte *codedMessage, byte mode, boolean last)
 {
-  nextMsg = codedMessage;
-}
+  c.codedMessage = codedMessage;
+  c.pos = 0;
+  c.itemsLeft = 0;
+  c.loopLeft = 0;
+  c.startMode = mode;
+  c.mode = mode;
+  c.state = SEGMENT_CARRIER_OFF;
+  c.length = 0;
+  c.implicitGap = 0;
+  c.last = last;
+  c.keyed = false;
+  c.ending = false;
+  c.done = false;
+  // Only the loop of the last $L counts, as in the beacon
+  for(int i = 0; codedMessage[i] != MORSE_END; i++)
+  {
+    if((codedMessage[i] >= MORSE_REPEAT(2)) && (codedMessage[i] <= MORSE_REPEAT(9)))
+    {
+      i++;
+    }
+    else if((codedMessage[i] >= MORSE_LOOP(2)) && (codedMessage[i] <= MORSE_LOOP(9)))
+    {
+      c.loopLeft = codedMessage[i] - MORSE_LOOP(0) - 1;
+    }
+  }
+}
+
+/*!
+ * Compile the next part of a message, as many characters and codes as fit. Sent one after the other, the parts
+ * take as long as the message compiled by morseCompileMessage(). Repeats and loops are compiled again every time,
+ * so a part has no control segments but SEGMENT_SENSOR, and a beacon needs little room for what it has queued.
+ *
+ * \param c            the state of the compiler, see morseCompileStart(). c.done is true after the last part.
+ * \param segments     the destination buffer
+ * \param maxSegments  the size of the destination buffer, room for the longest character (12) and more
+ *
+ * \return true on success, false if compiling fails
+ */
+boolean morseCompileNext(MorseCompiler &c, byte *segments, int maxSegments)
+{
+  SegmentWriter w;
+  morseParseError[0] = 0;
+  w.segments = segments;
+  w.maxSegments = maxSegments - 1; // We will always need a SEGMENT_END
+  w.pos = 0;
+  w.state = c.state;
+  w.length = c.length;
+  w.implicitGap = c.implicitGap;
+  w.full = false;
+  segments[0] = SEGMENT_END;
+
+  boolean ok = true;
+  while(ok && !c.ending)
+  {
+    byte code = c.codedMessage[c.pos];
+    if(code == MORSE_END)
+    {
+      if(c.itemsLeft && c.repeatLeft)
+      {
+        // A repeat that runs past the end goes on to the end
+        c.repeatLeft--;
+        c.itemsLeft = c.repeatItems;
+        c.pos = c.repeatStart;
+        c.mode = c.repeatMode;
+        continue;
+      }
+      c.itemsLeft = 0;
+      SegmentWriter before = w;
+      if(c.last && c.keyed && !compileEnd(w, c.mode))
+      {
+        ok = partFull(w, before);
+        break;
+      }
+      if(c.loopLeft)
+      {
+        c.loopLeft--;
+        c.pos = 0;
+        c.mode = c.startMode;
+      }
+      else
+      {
+        c.ending = true;
+      }
+    }
+    else if((code >= MORSE_REPEAT(2)) && (code <= MORSE_REPEAT(9)) && !c.itemsLeft)
+    {
+      c.repeatItems = c.codedMessage[c.pos + 1];
+      if((c.repeatItems == 0) || (c.repeatItems == MORSE_END))
+      {
+        sprintf_P(morseParseError, PSTR("Invalid repeat at position %d"), c.pos);
+        ok = false;
+      }
+      else
+      {
+        c.itemsLeft = c.repeatItems;
+        c.repeatLeft = code - MORSE_REPEAT(0) - 1;
+        c.pos += 2;
+        c.repeatStart = c.pos;
+        c.repeatMode = c.mode;
+      }
+    }
+    else if((code >= MORSE_LOOP(2)) && (code <= MORSE_LOOP(9)))
+    {
+      c.pos++;
+    }
+    else
+    {
+      SegmentWriter before = w;
+      byte mode = c.mode;
+      if(!compileCode(w, c.codedMessage, c.pos, &mode))
+      {
+        ok = partFull(w, before);
+        break;
+      }
+      c.mode = mode;
+      c.keyed = c.keyed || (code > POWER_MODE(3));
+      c.pos++;
+      if(c.itemsLeft && (--c.itemsLeft == 0) && c.repeatLeft)
+      {
+        c.repeatLeft--;
+        c.itemsLeft = c.repeatItems;
+        c.pos = c.repeatStart;
+        c.mode = c.repeatMode;
+      }
+    }
+  }
+  if(ok && c.ending)
+  {
+    // The rest of the message, unless it does not fit
+    c.done = segmentFlush(w);
+    ok = c.done || w.full;
+  }
+  c.state = w.state;
+  c.length = w.length;
+  c.implicitGap = w.implicitGap;
+  segments[w.pos] = SEGMENT_END;
+  if(!ok)
+  {
+    segments[0] = SEGMENT_END;
+  }
+  return ok;
+}
+
+// Length of the current value of a sensor in dots, as Beacon::nextSensorElement() sends it
+static unsigned sensorDots(byte sensor)
+{
+  const byte *value = sensorMorse(sensor);
+  unsigned dots = 0;
+  for(byte i = 0; (i < SENSOR_MORSE_LENGTH) && (value[i] != MORSE_END); i++)
+  {
+    byte code = value[i];
+    byte elements = 7;
+    while(code & 0x80)
+    {
+      code <<= 1;
+      elements--;
+    }
+    if((elements == 0) || (elements > 6))
+    {
+      break;
+    }
+    for(byte e = 0; e < elements; e++)
+    {
+      code <<= 1;
+      dots += ((code & 0x80) ? DASH_LENGTH : DOT_LENGTH) + ((e + 1 < elements) ? ELEMENT_GAP : CHARACTER_GAP);
+    }
+  }
+  return dots;
+}
+
+/*!
+ * Returns the length of a compiled message in dots. Sensor values count as long as their current value,
+ * so measure a message just before it is queued.
+ */
+unsigned long morseMessageDots(const byte *segments)
+{
+  unsigned long dots = 0;
+  unsigned long repeatStart = 0;  // dots before the repeat being counted
+  byte repeatTimes = 1;
+  byte loopTimes = 1;
+  for(; *segments != SEGMENT_END; segments++)
+  {
+    switch(*segments)
+    {
+      case SEGMENT_LOOP:
+        loopTimes = *++segments;
+        break;
+      case SEGMENT_REPEAT:
+        repeatTimes = *++segments;
+        repeatStart = dots;
+        break;
+      case SEGMENT_REPEAT_END:
+        dots = repeatStart + (dots - repeatStart) * repeatTimes;
+        break;
+      default:
+        if((*segments & SEGMENT_STATE_MASK) == SEGMENT_CONTROL)
+        {
+          // Sensor value
+          dots += sensorDots(*++segments);
+        }
+        else
+        {
+          dots += (*segments & SEGMENT_LENGTH_MASK) + 1;
+        }
+        break;
+    }
+  }
+  return dots * loopTimes;
+}
+
+/*!
+ * Converts a number of dots at a given speed to beacon ticks
+ */
+unsigned long morseDotsToTicks(unsigned long dots, byte wpm)
+{
+  return (dots * DOT_TICKS_NUMERATOR) / DOT_TICKS_DENOMINATOR(wpm);
+}
+
+/*!
+ * Decode a morse-encoded byte back to its character
+ *
+ * \return the character, 0 if the code is not a known character
+ */
+char morseDecodeChar(byte code)
+{
+  for(char c = '!'; c <= 'Z'; c++)
+  {
+    if(pgm_read_byte(&morseCodes[(byte)c]) == code)
+    {
+      return c;
+    }
+  }
+  return 0;
+}
+
+// Walks through an encoded message as it is sent, with its repeats expanded
+struct MorseCursor
+{
+  const byte *code;
+  const byte *repeatStart;  // first code of the repeat being walked through
+  byte repeatItems;         // codes in the repeat
+  byte itemsLeft;           // codes left in this pass of the repeat, 0 when not in a repeat
+  byte timesLeft;           // passes left after this one
+};
+
+// Step over the codes that are not sent: the start of a repeat and a loop
+static void morseCursorSettle(MorseCursor &c)
+{
+  for(;;)
+  {
+    if((*c.code >= MORSE_REPEAT(2)) && (*c.code <= MORSE_REPEAT(9)))
+    {
+      c.timesLeft = *c.code - MORSE_REPEAT(1);
+      c.repeatItems = c.itemsLeft = c.code[1];
+      c.code += 2;
+      c.repeatStart = c.code;
+    }
+    else if((*c.code >= MORSE_LOOP(2)) && (*c.code <= MORSE_LOOP(9)))
+    {
+      c.code++;
+    }
+    else
+    {
+      return;
+    }
+  }
+}
+
+static void morseCursorNext(MorseCursor &c)
+{
+  c.code++;
+  if(c.itemsLeft && ((--c.itemsLeft == 0) || (*c.code == MORSE_END)) && c.timesLeft)
+  {
+    c.timesLeft--;
+    c.code = c.repeatStart;
+    c.itemsLeft = c.repeatItems;
+  }
+  morseCursorSettle(c);
+}
+
+// Match a word against the word of a message that starts at the cursor.
+// A sensor value matches 1 up to SENSOR_MORSE_LENGTH-1 characters, whichever lets the rest match.
+static boolean morseWordMatches(MorseCursor c, const byte *word, byte length)
+{
+  for(;; morseCursorNext(c))
+  {
+    byte code = *c.code;
+    if(code & 0x80)
+    {
+      if((length == 0) || (*word != code))
+      {
+        return false;
+      }
+      word++;
+      length--;
+    }
+    else if((code >= SENSOR_VALUE(0)) && (code < SENSOR_VALUE(SENSOR_COUNT)))
+    {
+      morseCursorNext(c);
+      for(byte n = 1; (n < SENSOR_MORSE_LENGTH) && (n <= length); n++)
+      {
+        if(morseWordMatches(c, word + n, length - n))
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+    else if(code > POWER_MODE(3))
+    {
+      // Space, delay or end of the message: end of the word
+      return length == 0;
+    }
+  }
+}
+
+/*!
+ * Check if a word of morse-encoded characters is sent as a whole word by an encoded message.
+ * A sensor value matches any 1 to SENSOR_MORSE_LENGTH-1 characters.
+ *
+ * \param codedMessage  the message, as encoded by morseEncodeMessage
+ * \param word          the encoded characters of the word, see morseEncodeChar()
+ * \param length        number of characters in the word
+ */
+boolean morseMessageHasWord(const byte *codedMessage, const byte *word, byte length)
+{
+  MorseCursor c;
+  c.code = codedMessage;
+  c.itemsLeft = 0;
+  c.timesLeft = 0;
+  morseCursorSettle(c);
+  boolean wordStart = true;
+  for(; *c.code != MORSE_END; morseCursorNext(c))
+  {
+    if(wordStart && length && morseWordMatches(c, word, length))
+    {
+      return true;
+    }
+    wordStart = (*c.code == MORSE_SPACE) || ((*c.code > DELAY_CARRIER_ON(0)) && (*c.code <= DELAY_CARRIER_OFF(9)));
+  }
+  return false;
+}
+
+/*!
+ * Returns the size of an encoded message in bytes, including the MORSE_END
+ */
+int morseEncodedLength(const byte *codedMessage)
+{
+  int len = 0;
+  while(codedMessage[len] != MORSE_END)
+  {
+    len++;
+  }
+  return len + 1;
+}
+
+/*!
+ * Returns a human-readable string detailing the last error while parsing a morse string (if any)
+ * /returns a human-readable error message or "" if there was no error.
+ * /sa morseEncodeMessage()
+ */
+const char* morseGetError()
+{
+  return morseParseError;
+}
+
+void debugPrintMorse(const char *msg)
+{
+  for(int i = 0; msg[i]!=MORSE_END; i++)
+  {
+    Serial.println((byte)(msg[i]), BIN);
+  }
+  Serial.println(F("---END OF MESSAGE---"));
+}
+
+/********************************************************************************************************\
+|***                                                                                                  ***|
+|***                                         Beacon Clock                                             ***|
+|***                                                                                                  ***|
+\********************************************************************************************************/
+
+static volatile time_t clockSeconds;
+static volatile unsigned clockTicks;  // ticks within the current second
+static unsigned tickCount;            // free running, for Beacon::tick()
+static volatile uint16_t tickCompare; // Timer1 count of the last tick the clock was advanced to
+
+/*!
+ * Advance the beacon clock. Called by the beacon interrupt, before the beacons tick.
+ *
+ * \param ticks  ticks since the last call
+ *
+ * \return the tick number to pass to Beacon::tick()
+ */
+unsigned beaconClockAdvance(unsigned ticks)
+{
+  clockTicks += ticks;
+  while(clockTicks >= BEACON_TICK_RATE)
+  {
+    clockTicks -= BEACON_TICK_RATE;
+    clockSeconds++;
+  }
+  tickCount += ticks;
+  return tickCount;
+}
+
+/*!
+ * Set the beacon clock to the start of a second and restart the beacon timer, so the ticks stay
+ * in phase with the second boundaries of now(). Call this with interrupts disabled.
+ */
+void beaconClockSet(time_t t)
+{
+  clockSeconds = t;
+  clockTicks = 0;
+  TCNT1 = 0;
+  tickCompare = 0;
+  OCR1A = BEACON_TIMER_PERIOD;
+}
+
+/*!
+ * Read the beacon clock from the main loop.
+ */
+void beaconClockGet(BeaconTime *t)
+{
+  // The interrupt only advances the clock when a beacon needs it, add the ticks since then.
+  // Timer1 is read with interrupts off, the interrupt reads it too. They stay off if the caller turned them off.
+  uint8_t sreg = SREG;
+  cli();
+  t->seconds = clockSeconds;
+  t->ticks = clockTicks;
+  uint16_t since = TCNT1 - tickCompare;
+  SREG = sreg;
+  t->ticks += since / BEACON_TIMER_PERIOD;
+  while(t->ticks >= BEACON_TICK_RATE)
+  {
+    t->ticks -= BEACON_TICK_RATE;
+    t->seconds++;
+  }
+}
+
+/********************************************************************************************************\
+|***                                                                                                  ***|
+|***                                         Beacon Interrupt                                         ***|
+|***                                                                                                  ***|
+\********************************************************************************************************/
+
+// Longest time between two interrupts. Within half the range of the 16 bit Timer1, a compare match
+// that already passed can still be told apart from one that is yet to come.
+#define MAX_SLEEP_TICKS ((0x7FFFUL / BEACON_TIMER_PERIOD) - 1)
+
+extern Beacon beacons[BEACON_COUNT];
+
+/*!
+ * Body of the beacon interrupt (Timer1 compare match A): run the beacons, then update all their outputs at once.
+ * Timer1 runs freely. The compare match is set to the tick at which the first beacon has something to do,
+ * beacons that are due at the same tick share the interrupt.
+ */
+void beaconInterrupt()
+{
+  uint16_t entry = TCNT1;
+  uint16_t late = entry - OCR1A;
+  // If the interrupt was held up for more than a period, count the ticks that passed in the mean time.
+  unsigned missed = late / BEACON_TIMER_PERIOD;
+  uint16_t compare = OCR1A + missed * BEACON_TIMER_PERIOD;
+  unsigned ticks = beaconClockAdvance((uint16_t)(compare - tickCompare) / BEACON_TIMER_PERIOD);
+  tickCompare = compare;
+
+  unsigned sleep = MAX_SLEEP_TICKS;
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+#ifdef ENABLE_ISR_STATS
+    uint16_t start = ISR_STATS_NOW();
+    beacons[i].tick(ticks);
+    ISR_STATS_RECORD_TICK(i, (uint16_t)(ISR_STATS_NOW() - start));
+#else
+    beacons[i].tick(ticks);
+#endif
+    unsigned idle = beacons[i].idleTicks(ticks);
+    if(idle < sleep)
+    {
+      sleep = idle;
+    }
+  }
+  outputCommit();
+
+  if(sleep == 0)
+  {
+    sleep = 1;
+  }
+  compare += sleep * BEACON_TIMER_PERIOD;
+  // Do not set a compare match that already passed, it would only come back after the timer wraps around
+  while((int16_t)(TCNT1 - compare) >= 0)
+  {
+    compare += BEACON_TIMER_PERIOD;
+  }
+  OCR1A = compare;
+  ISR_STATS_RECORD(ISR_STATS_LATENCY, late);
+  ISR_STATS_RECORD(ISR_STATS_MISSED, missed);
+  ISR_STATS_RECORD(ISR_STATS_DURATION, (uint16_t)(ISR_STATS_NOW() - entry));
+}
+
+/********************************************************************************************************\
+|***                                                                                                  ***|
+|***                                         Beacon Class                                             ***|
+|***                                                                                                  ***|
+\********************************************************************************************************/
+
+
+void Beacon::keyOn()
+{
+  outputSet(normalPin, 1);
+  outputSet(invPin, 0);
+}
+void Beacon::keyOff()
+{
+  outputSet(normalPin, 0);
+  outputSet(invPin, 1);
+}
+void Beacon::carrierOff()
+{
+  outputSet(normalPin, 0);
+  outputSet(invPin, 0);
+}
+
+void Beacon::powerMode(byte mode)
+{
+  outputSet(modePin0, mode & 1);
+  outputSet(modePin1, mode & 2);
+}
+
+void Beacon::output(byte state)
+{
+  // Only touch the outputs when something changes
+  if(((state ^ outputState) & (SEGMENT_STATE_MASK | SEGMENT_MODE_MASK)) == 0)
+  {
+    return;
+  }
+  switch(state & SEGMENT_STATE_MASK)
+  {
+    case SEGMENT_KEY_ON:
+      keyOn();
+      break;
+    case SEGMENT_KEY_OFF:
+      keyOff();
+      break;
+    default:
+      carrierOff();
+      break;
+  }
+  if((state ^ outputState) & SEGMENT_STATE_MASK)
+  {
+    boolean on = (state & SEGMENT_STATE_MASK) == SEGMENT_KEY_ON;
+    if(shaping != SHAPING_NONE)
+    {
+      shapingKey(shaping, on);
+    }
+    if(sampling != KEYED_ADC_NONE)
+    {
+      keyedAdcKey(sampling, on);
+    }
+  }
+  powerMode((state & SEGMENT_MODE_MASK) >> 4);
+  outputState = state;
+}
+
+Beacon::Beacon(int normalPin, int invPin, int modePin0, int modePin1)
+{
+  begin(normalPin, invPin, modePin0, modePin1);
+}
+Beacon::Beacon()
+{
+  end();
+}
+/*!
+ * Attach the beacon to its output pins. Must be called before the beacon interrupt is started.
+ */
+void Beacon::begin(int normalPin, int invPin, int modePin0, int modePin1)
+{
+  outputAttachPin(normalPin, &this->normalPin);
+  outputAttachPin(invPin, &this->invPin);
+  outputAttachPin(modePin0, &this->modePin0);
+  outputAttachPin(modePin1, &this->modePin1);
+  shaping = SHAPING_NONE;
+  sampling = KEYED_ADC_NONE;
+  enabled = true;
+  queueHead = queueTail = 0;
+  segment = 0;
+  sendingSensor = false;
+  loopLeft = 0;
+  due = 0;
+  wakeup = true;
+  setSpeed(BEACON_DEFAULT_WPM);
+  applySpeed();
+  carrierOff();
+  powerMode(0);
+  outputState = SEGMENT_CARRIER_OFF;
+  outputCommit();
+}
+
+/*!
+ * Shape the keying: besides the normal and inverted outputs, drive a PWM pin with a smooth envelope of the keying.
+ * Call after begin(), before the beacon interrupt is started.
+ *
+ * \param pwmPin  a PWM pin of Timer3, 4 or 5, see shapingAttachPin()
+ *
+ * \return true on success, false if the pin can not be used
+ */
+boolean Beacon::shapeKeying(int pwmPin)
+{
+  shaping = shapingAttachPin(pwmPin);
+  return shaping != SHAPING_NONE;
+}
+
+/*!
+ * Sample the power detectors of the beacon after every key change, see KeyedAdc.h.
+ * Call after begin(), before the beacon interrupt is started.
+ *
+ * \param channel  as returned by keyedAdcAttach(), KEYED_ADC_NONE to stop sampling
+ */
+void Beacon::samplePower(byte channel)
+{
+  sampling = channel;
+}
+
+void Beacon::end()
+{
+  setEnabled(false);
+  normalPin.mask = invPin.mask = modePin0.mask = modePin1.mask = 0;
+  shaping = SHAPING_NONE;
+  sampling = KEYED_ADC_NONE;
+  queueHead = queueTail = 0;
+  segment = 0;
+  sendingSensor = false;
+  loopLeft = 0;
+  outputState = SEGMENT_CARRIER_OFF;
+  setSpeed(BEACON_DEFAULT_WPM);
+  applySpeed();
+}
+
+// Recalculate the dot length after a speed change
+void Beacon::applySpeed()
+{
+  wpm = requestedWpm;
+  dotDivisor = DOT_TICKS_DENOMINATOR(wpm);
+  dotTicks = DOT_TICKS_NUMERATOR / dotDivisor;
+  dotRemainder = DOT_TICKS_NUMERATOR % dotDivisor;
+  dotError = 0;
+}
+
+/*!
+ * Check if the message at the head of the queue has to wait for its start time.
+ * If it does, the next tick is scheduled at the start time.
+ */
+boolean Beacon::waitForStart(unsigned now)
+{
+  time_t startAt = queueStart[queueTail & (BEACON_QUEUE_LENGTH - 1)];
+  if((startAt == 0) || ((long)(clockSeconds - startAt) >= 0))
+  {
+    return false;
+  }
+  unsigned long wait = (unsigned long)(startAt - clockSeconds) * BEACON_TICK_RATE - clockTicks;
+  due = now + ((wait < IDLE_TICKS) ? (unsigned)wait : IDLE_TICKS);
+  return true;
+}
+
+/*!
+ * Start sending a sensor value. Takes a copy of the value, so it does not change halfway.
+ *
+ * \param control  the SEGMENT_SENSOR segment
+ */
+void Beacon::startSensor(const byte *control)
+{
+  const byte *value = sensorMorse(control[1]);
+  for(byte i = 0; i < SENSOR_MORSE_LENGTH; i++)
+  {
+    sensorValue[i] = value[i];
+  }
+  sensorMode = (control[0] - SEGMENT_SENSOR(0)) << 4;
+  sensorPos = 0;
+  sensorElements = 0;
+  sendingSensor = true;
+}
+
+/*!
+ * Get the next element or gap of the sensor value being sent.
+ *
+ * \param state  receives the element as a segment
+ *
+ * \return false when the whole value has been sent
+ */
+boolean Beacon::nextSensorElement(byte *state)
+{
+  if(sensorElements == 0)
+  {
+    if((sensorPos == SENSOR_MORSE_LENGTH) || (sensorValue[sensorPos] == MORSE_END))
+    {
+      return false;
+    }
+    // Remove filler and the 0 that follows it, as in morseCompileMessage()
+    byte code = sensorValue[sensorPos++];
+    byte elements = 7;
+    while(code & 0x80)
+    {
+      code <<= 1;
+      elements--;
+    }
+    if((elements == 0) || (elements > 6))
+    {
+      return false;
+    }
+    sensorCode = code << 1;
+    sensorElements = elements;
+    sensorMark = true;
+  }
+  if(sensorMark)
+  {
+    *state = SEGMENT_KEY_ON | sensorMode | (((sensorCode & 0x80) ? DASH_LENGTH : DOT_LENGTH) - 1);
+    sensorCode <<= 1;
+    sensorMark = false;
+  }
+  else
+  {
+    sensorElements--;
+    *state = SEGMENT_KEY_OFF | sensorMode | ((sensorElements ? ELEMENT_GAP : CHARACTER_GAP) - 1);
+    sensorMark = true;
+  }
+  return true;
+}
+
+/*!
+ * Start the next segment when the current one is due. Only counts down time,
+ * the outputs are changed when a new segment starts.
+ *
+ * \param now  the current tick
+ */
+void Beacon::advance(unsigned now)
+{
+  wakeup = false;
+  if(!enabled)
+  {
+    // Forget what we were sending, and the rest of the queue, and turn off the outputs
+    queueTail = queueHead;
+    segment = 0;
+    sendingSensor = false;
+    loopLeft = 0;
+    output(SEGMENT_CARRIER_OFF);
+    due = now + IDLE_TICKS;
+    return;
+  }
+  if(segment)
+  {
+    if((int)(now - due) < 0)
+    {
+      return; // Woken up early, the current segment is not finished yet
+    }
+    if(!sendingSensor)
+    {
+      segment++;
+    }
+  }
+  else
+  {
+    // Idle, waiting for a message
+    if(queueHead == queueTail)
+    {
+      due = now + IDLE_TICKS;
+      return;
+    }
+    if(waitForStart(now))
+    {
+      return;
+    }
+    segment = queue[queueTail & (BEACON_QUEUE_LENGTH - 1)];
+    due = now;
+  }
+  byte state;
+  for(;;)
+  {
+    if(sendingSensor)
+    {
+      if(nextSensorElement(&state))
+      {
+        break;
+      }
+      sendingSensor = false;
+      segment += 2;
+    }
+    if(*segment != SEGMENT_END)
+    {
+      if((*segment & SEGMENT_STATE_MASK) != SEGMENT_CONTROL)
+      {
+        state = *segment;
+        break;
+      }
+      switch(*segment)
+      {
+        case SEGMENT_LOOP:
+          loopLeft = segment[1] - 1;
+          segment += 2;
+          break;
+        case SEGMENT_REPEAT:
+          repeatLeft = segment[1] - 1;
+          segment += 2;
+          repeatStart = segment;
+          break;
+        case SEGMENT_REPEAT_END:
+          if(repeatLeft)
+          {
+            repeatLeft--;
+            segment = repeatStart;
+          }
+          else
+          {
+            segment++;
+          }
+          break;
+        default:
+          startSensor(segment);
+          break;
+      }
+      continue;
+    }
+    if(loopLeft)
+    {
+      // Again from the start, after the SEGMENT_LOOP
+      loopLeft--;
+      segment = queue[queueTail & (BEACON_QUEUE_LENGTH - 1)] + 2;
+      continue;
+    }
+    // Message done, continue with the next one right away if there is one
+    queueTail++;
+    if(queueHead == queueTail)
+    {
+      segment = 0;
+      output(SEGMENT_CARRIER_OFF | (outputState & SEGMENT_MODE_MASK));
+      due = now + IDLE_TICKS;
+      return;
+    }
+    if(waitForStart(now))
+    {
+      segment = 0;
+      output(SEGMENT_CARRIER_OFF | (outputState & SEGMENT_MODE_MASK));
+      return;
+    }
+    segment = queue[queueTail & (BEACON_QUEUE_LENGTH - 1)];
+  }
+  if(requestedWpm != wpm)
+  {
+    applySpeed();
+  }
+  output(state);
+
+  // Schedule the end of the segment, relative to the end of the previous one so there is no drift
+  byte dots = (state & SEGMENT_LENGTH_MASK) + 1;
+  due += dots * dotTicks;
+  dotError += dots * dotRemainder;
+  while(dotError >= dotDivisor)
+  {
+    dotError -= dotDivisor;
+    due++;
+  }
+}
+
+/*!
+ * Returns true if the beacon has nothing left to send
+ */
+boolean Beacon::isDone()
+{
+  return (enabled==false) || ((segment==0) && (queueHead==queueTail));
+}
+
+/*!
+ * Returns the number of messages that can be queued without waiting
+ */
+byte Beacon::queueSpace()
+{
+  return BEACON_QUEUE_LENGTH - (byte)(queueHead - queueTail);
+}
+
+/*!
+ * Returns the number of messages queued so far. It counts on and wraps around, queueFinished() less than this
+ * are still in the queue.
+ */
+byte Beacon::queueQueued()
+{
+  return queueHead;
+}
+
+/*!
+ * Returns the number of queued messages that were sent or dropped so far. It counts on and wraps around.
+ */
+byte Beacon::queueFinished()
+{
+  return queueTail;
+}
+
+/*!
+ * Returns the second the n-th queued message starts at, as given to queueMessage(). Only valid for the messages
+ * still in the queue.
+ *
+ * \param n  the count of the message, from queueFinished() up to queueQueued()
+ */
+time_t Beacon::queueStartAt(byte n)
+{
+  return queueStart[n & (BEACON_QUEUE_LENGTH - 1)];
+}
+
+/*!
+ * Returns the position (0 ... BEACON_QUEUE_LENGTH-1) the next queued message will take in the queue.
+ * Storage used for an earlier message at this position is no longer in use when queueSpace() is nonzero,
+ * so it can be reused for the next message.
+ */
+byte Beacon::queueIndex()
+{
+  return queueHead & (BEACON_QUEUE_LENGTH - 1);
+}
+
+/*!
+ * Queue a compiled message. Only call this from the main loop and only if queueSpace() is nonzero.
+ * The segments must stay untouched until the message is sent, see queueIndex().
+ *
+ * \param segments  the compiled message
+ * \param startAt   if nonzero, the message starts exactly at this second of the beacon clock.
+ *                  The beacon stays quiet until then. If that second has passed, it starts right away.
+ *
+ * \sa morseCompileMessage(), beaconClockGet()
+ */
+void Beacon::queueMessage(const byte *segments, time_t startAt)
+{
+  queue[queueHead & (BEACON_QUEUE_LENGTH - 1)] = segments;
+  queueStart[queueHead & (BEACON_QUEUE_LENGTH - 1)] = startAt;
+  queueHead++;  // publishes the message to tick()
+  wakeup = true;
+}
 
 bool Beacon::getEnabled()
 {
   return enabled;
 }
+/*!
+ * Start/stop the beacon. When stopped, the outputs are turned off at the next tick.
+ */
 void Beacon::setEnabled(bool on)
 {
-  if(on)
+  enabled = on;
+  wakeup = true;
+}
+
+/*!
+ * Set the keying speed. Takes effect at the next segment.
+ *
+ * \param wpm  words per minute, limited to BEACON_MIN_WPM ... BEACON_MAX_WPM
+ */
+void Beacon::setSpeed(byte wpm)
+{
+  if(wpm < BEACON_MIN_WPM)
   {
-    enabled = true;
+    wpm = BEACON_MIN_WPM;
   }
-  else
+  if(wpm > BEACON_MAX_WPM)
   {
-    done = true; // Forget what we were sending
-    enabled = false;
-    // Turn off outputs
-    carrierOff();
-    powerMode(0);
+    wpm = BEACON_MAX_WPM;
   }
+  requestedWpm = wpm;
+}
+
+byte Beacon::getSpeed()
+{
+  return requestedWpm;
 }
@@ -2,51 +2,180 @@
 #define BEACONCONTROLLER_H_
 
 #include <Arduino.h>
+#include <TimeLib.h>
+#include "Config.h"
+#include "Sensors.h"
+#include "BeaconOutput.h"
+#include "KeyShaping.h"
+#include "KeyedAdc.h"
+
+// A compiled message is a flat array of segments, one byte each:
+//   bits 7-6: output state during the segment, or SEGMENT_CONTROL
+//   bits 5-4: power mode during the segment
+//   bits 3-0: duration of the segment in dot lengths, minus one (1-16 dots)
+// Longer runs are split over several segments.
+// Control segments have an opcode in bits 5-0 instead:
+//   SEGMENT_END           end of the message
+//   SEGMENT_SENSOR(mode)  followed by a sensor number: the value of the sensor as it is at that
+//                         moment (see sensorMorse()), sent in the given power mode
+//   SEGMENT_REPEAT        followed by a count: send the segments up to SEGMENT_REPEAT_END that many times
+//   SEGMENT_REPEAT_END    end of the repeated segments
+//   SEGMENT_LOOP          followed by a count, only at the start: send the whole message that many times
+#define SEGMENT_CARRIER_OFF  0x00
+#define SEGMENT_KEY_ON       0x40
+#define SEGMENT_KEY_OFF      0x80
+#define SEGMENT_CONTROL      0xC0
+#define SEGMENT_END          0xC0
+#define SEGMENT_SENSOR(mode) (0xC1 + (mode))
+#define SEGMENT_REPEAT       0xC5
+#define SEGMENT_REPEAT_END   0xC6
+#define SEGMENT_LOOP         0xC7
+#define SEGMENT_STATE_MASK   0xC0
+#define SEGMENT_MODE_MASK    0x30
+#define SEGMENT_LENGTH_MASK  0x0F
+#define SEGMENT_MAX_LENGTH   16
+
+// Last byte of a message encoded by morseEncodeMessage()
+#define MORSE_END 0x7F
 
 byte morseEncodeChar(char c);
 boolean morseEncodeMessage(byte *codedMessage, const char *str, int maxBytes);
+int morseEncodedLength(const byte *codedMessage);
+char morseDecodeChar(byte code);
+boolean morseMessageHasWord(const byte *codedMessage, const byte *word, byte length);
+boolean morseCompileMessage(byte *segments, const byte *codedMessage, int maxSegments);
+boolean morseCompilePart(byte *segments, const byte *codedMessage, int maxSegments, byte *modeInOut, boolean last);
+
+// Where compiling a message a part at a time has got to, see morseCompileNext()
+struct MorseCompiler
+{
+  const byte *codedMessage;
+  byte pos;           // next character or code
+  byte repeatStart;   // first character of the repeat being compiled
+  byte repeatItems;   // characters and codes in the repeat
+  byte itemsLeft;     // left in this time through the repeat, 0 outside a repeat
+  byte repeatLeft;    // times the repeat is compiled again
+  byte repeatMode;    // power mode at the start of the repeat
+  byte loopLeft;      // times the whole message is compiled again
+  byte startMode;     // power mode at the start of the message
+  byte mode;
+  byte state;         // output state and power mode of the run that is not written yet
+  unsigned length;    // its length in dots
+  byte implicitGap;
+  boolean last;       // the message ends with a word gap
+  boolean keyed;      // there is something to send
+  boolean ending;     // only the rest of the run is left
+  boolean done;       // all parts are compiled
+};
+void morseCompileStart(MorseCompiler &c, const byte *codedMessage, byte mode, boolean last);
+boolean morseCompileNext(MorseCompiler &c, byte *segments, int maxSegments);
+unsigned long morseMessageDots(const byte *segments);
+unsigned long morseDotsToTicks(unsigned long dots, byte wpm);
 const char* morseGetError();
 
+// Time kept by the beacon interrupt. Its second boundaries are locked to the ticks.
+struct BeaconTime
+{
+  time_t seconds;
+  unsigned ticks;   // 0 ... BEACON_TICK_RATE-1 within the second
+};
+
+unsigned beaconClockAdvance(unsigned ticks);
+void beaconClockSet(time_t t);
+void beaconClockGet(BeaconTime *t);
+
+void beaconInterrupt();
+
 class Beacon
 {
-  int normalPin;
-  int invPin;
-  int modePin0;
-  int modePin1;
+  OutputPin normalPin;
+  OutputPin invPin;
+  OutputPin modePin0;
+  OutputPin modePin1;
+  byte shaping;  // key shaping channel, SHAPING_NONE for hard keying
+  byte sampling; // power detector channel, sampled at the key changes, KEYED_ADC_NONE if there is none
   
-  byte *nextMsg;
+  // Compiled messages, or parts of them, waiting to be sent. Single producer (main loop), single consumer (tick()):
+  // only the main loop writes queueHead, only tick() writes queueTail.
+  // The message being sent stays at queueTail until it is finished.
+  const byte * volatile queue[BEACON_QUEUE_LENGTH];
+  volatile time_t queueStart[BEACON_QUEUE_LENGTH];  // second to start at, 0 to start right away
+  volatile byte queueHead;
+  volatile byte queueTail;
 
-  byte *msg;
-  int msgPos;
-  byte bitPos;  // 0-7
-  byte code;    // contains a copy of the current byte being sent, current bit is MSB
-  
-  // State while transmitting is determined by these 3 variables:
-  // cmdPause for when a pause command byte is being processed
-  // onPause when a dit or a dah is being transmitted
-  // offPause when a intra- or inter-symbol delay is being transmitted
-  unsigned cmdPause;
-  byte onPause;
-  byte offPause;
-  
-  boolean done;
+  const byte *segment;  // segment being transmitted, 0 when idle
+  unsigned due;         // tick at which the current segment ends
+  byte outputState;     // state and power mode of the outputs, as in a segment
+
+  // Sensor value being sent, copied from sensorMorse() when its segment starts
+  byte sensorValue[SENSOR_MORSE_LENGTH];
+  byte sensorPos;       // next character in sensorValue
+  byte sensorCode;      // current character, next element in the MSB
+  byte sensorElements;  // elements left in the current character
+  byte sensorMode;      // power mode, as in a segment
+  boolean sensorMark;   // next is an element, otherwise the gap after it
+  boolean sendingSensor;
+
+  const byte *repeatStart;  // first segment of the repeat being sent
+  byte repeatLeft;          // times the repeat is to be sent again
+  byte loopLeft;            // times the message is to be sent again
+
+  // Dot length in ticks is dotTicks + dotRemainder/dotDivisor, the fraction is
+  // spread over the dots with an error accumulator so the speed does not drift.
+  byte wpm;
+  volatile byte requestedWpm;
+  unsigned dotTicks;
+  unsigned dotRemainder;
+  unsigned dotDivisor;
+  unsigned dotError;
+
+  volatile boolean wakeup;  // set by the main loop when the beacon should not wait for due
   boolean enabled;
   
+  // These only prepare the next state of the outputs, see outputCommit()
   void keyOn();                // Sets the normal output
   void keyOff();               // Sets the inverted output
   void carrierOff();           // Sets both outputs to off
   void powerMode(byte mode);   // Sets the 2 mode pins to a specific state
+  void output(byte state);     // Sets all outputs as described by a segment
+  void applySpeed();
+  boolean waitForStart(unsigned now);
+  void startSensor(const byte *control);
+  boolean nextSensorElement(byte *state);
+  void advance(unsigned now);
 
   public:
   Beacon(int normalPin, int invPin, int modePin0, int modePin1);
   Beacon();
   void begin(int normalPin, int invPin, int modePin0, int modePin1);
   void end();
-  void tick();
+  boolean shapeKeying(int pwmPin);
+  void samplePower(byte channel);
+  // Called by the beacon interrupt at every tick, does nothing until the current segment is due
+  void tick(unsigned now)
+  {
+    if(wakeup || ((int)(now - due) >= 0))
+    {
+      advance(now);
+    }
+  }
+  // Ticks until tick() has something to do
+  unsigned idleTicks(unsigned now)
+  {
+    int left = due - now;
+    return (wakeup || (left < 0)) ? 0 : left;
+  }
   boolean isDone();
-  void setNextMessage(byte *codedMessage);
+  byte queueSpace();
+  byte queueIndex();
+  byte queueQueued();
+  byte queueFinished();
+  time_t queueStartAt(byte n);
+  void queueMessage(const byte *segments, time_t startAt = 0);
   void setEnabled(bool on); // Start/stop the beacon.
   bool getEnabled();
+  void setSpeed(byte wpm);
+  byte getSpeed();
 };
 
 #endif
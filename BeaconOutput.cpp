@@ -0,0 +1,186 @@
+#include "BeaconOutput.h"
+
+OutputPort outputPorts[OUTPUT_MAX_PORTS];
+static byte outputPortCount = 0;
+
+#if OUTPUT_SHIFT_REGISTERS
+// A pin of the shift register chain, resolved to its PORTx register
+struct ShiftPin
+{
+  volatile uint8_t *reg;
+  byte mask;
+};
+
+static byte shiftImage[OUTPUT_SHIFT_REGISTERS];  // written by outputCommit() like a port
+static byte shiftSent[OUTPUT_SHIFT_REGISTERS];   // what the registers hold now
+static boolean shiftStarted = false;
+static boolean shiftEnabled = false;             // OE is low
+static ShiftPin shiftData, shiftClock, shiftLatch, shiftOE;
+
+static void shiftAttachPin(int pin, byte level, ShiftPin *dest)
+{
+  pinMode(pin, OUTPUT);
+  dest->reg = portOutputRegister(digitalPinToPort(pin));
+  dest->mask = digitalPinToBitMask(pin);
+  if(level)
+  {
+    *dest->reg |= dest->mask;
+  }
+  else
+  {
+    *dest->reg &= ~dest->mask;
+  }
+}
+
+// Set up the pins of the chain, with the outputs disabled until the first outputCommit()
+static void shiftBegin()
+{
+  shiftAttachPin(OUTPUT_SHIFT_OE_PIN, HIGH, &shiftOE);
+  shiftAttachPin(OUTPUT_SHIFT_DATA_PIN, LOW, &shiftData);
+  shiftAttachPin(OUTPUT_SHIFT_CLOCK_PIN, LOW, &shiftClock);
+  shiftAttachPin(OUTPUT_SHIFT_LATCH_PIN, LOW, &shiftLatch);
+  shiftStarted = true;
+}
+
+// Clock the image out, the register at the far end of the chain first and every register MSB first,
+// then latch all registers at once
+static void shiftCommit()
+{
+  byte i = OUTPUT_SHIFT_REGISTERS;
+  boolean changed = !shiftEnabled;
+  while(i--)
+  {
+    changed |= (shiftImage[i] != shiftSent[i]);
+  }
+  if(!changed)
+  {
+    return;
+  }
+  for(i = OUTPUT_SHIFT_REGISTERS; i-- > 0; )
+  {
+    byte bits = shiftImage[i];
+    shiftSent[i] = bits;
+    for(byte mask = 0x80; mask; mask >>= 1)
+    {
+      if(bits & mask)
+      {
+        *shiftData.reg |= shiftData.mask;
+      }
+      else
+      {
+        *shiftData.reg &= ~shiftData.mask;
+      }
+      *shiftClock.reg |= shiftClock.mask;
+      *shiftClock.reg &= ~shiftClock.mask;
+    }
+  }
+  *shiftLatch.reg |= shiftLatch.mask;
+  *shiftLatch.reg &= ~shiftLatch.mask;
+  if(!shiftEnabled)
+  {
+    *shiftOE.reg &= ~shiftOE.mask;
+    shiftEnabled = true;
+  }
+}
+#endif
+
+// Find the port of a PORTx register or shift register image, or add it to the table
+static boolean findPort(volatile uint8_t *reg, byte *port)
+{
+  byte i;
+  for(i = 0; i < outputPortCount; i++)
+  {
+    if(outputPorts[i].reg == reg)
+    {
+      *port = i;
+      return true;
+    }
+  }
+  if(outputPortCount == OUTPUT_MAX_PORTS)
+  {
+    return false;
+  }
+  outputPorts[i].reg = reg;
+  outputPorts[i].mask = 0;
+  outputPorts[i].value = 0;
+  outputPortCount++;
+  *port = i;
+  return true;
+}
+
+/*!
+ * Configure an Arduino pin or shift register output as an output and resolve it to a port and bit mask,
+ * so it can be changed together with all other output pins on the same port.
+ *
+ * \param pin   Arduino pin number, or OUTPUT_SHIFT(i) for output i of the shift register chain
+ * \param dest  receives the resolved pin. Set to an unused pin if this fails.
+ *
+ * \return true on success, false if the pin does not exist or there are too many ports in use
+ */
+boolean outputAttachPin(int pin, OutputPin *dest)
+{
+  dest->port = 0;
+  dest->mask = 0;
+  volatile uint8_t *reg;
+  byte mask;
+  if(pin >= OUTPUT_SHIFT(0))
+  {
+#if OUTPUT_SHIFT_REGISTERS
+    int i = pin - OUTPUT_SHIFT(0);
+    if(i >= 8 * OUTPUT_SHIFT_REGISTERS)
+    {
+      return false;
+    }
+    if(!shiftStarted)
+    {
+      shiftBegin();
+    }
+    reg = &shiftImage[i / 8];
+    mask = 1 << (i % 8);
+#else
+    return false;
+#endif
+  }
+  else
+  {
+    if((pin < 0) || (digitalPinToPort(pin) == NOT_A_PORT))
+    {
+      return false;
+    }
+    reg = portOutputRegister(digitalPinToPort(pin));
+    mask = digitalPinToBitMask(pin);
+  }
+  byte port;
+  if(!findPort(reg, &port))
+  {
+    return false;
+  }
+  if(pin < OUTPUT_SHIFT(0))
+  {
+    pinMode(pin, OUTPUT);
+  }
+  dest->port = port;
+  dest->mask = mask;
+  outputPorts[port].mask |= mask;
+  return true;
+}
+
+/*!
+ * Write the state set by outputSet() to the hardware, with one masked write per port, and latch it into
+ * the shift registers if any of them changed.
+ * Must be called with interrupts disabled, so it is not mixed up with other writes to the same port.
+ */
+void outputCommit()
+{
+  for(byte i = 0; i < outputPortCount; i++)
+  {
+    OutputPort &p = outputPorts[i];
+    *p.reg = (*p.reg & ~p.mask) | p.value;
+  }
+#if OUTPUT_SHIFT_REGISTERS
+  if(shiftStarted)
+  {
+    shiftCommit();
+  }
+#endif
+}
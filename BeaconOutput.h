@@ -0,0 +1,50 @@
+#ifndef BEACONOUTPUT_H_
+#define BEACONOUTPUT_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// The beacon outputs are Arduino pins, or outputs of a chain of 74HC595 shift registers.
+// Output OUTPUT_SHIFT(i) is bit i % 8 of register i / 8, counting from the register nearest to the Arduino.
+// Every register of the chain is handled as one more port, and outputCommit() clocks the whole chain
+// out and latches it when one of them changed, so all shift register outputs change in the same instant.
+#define OUTPUT_SHIFT(i) (0x100 + (i))
+
+// Maximum number of different AVR ports the beacon outputs can be spread over, plus the shift registers
+#define OUTPUT_MAX_PORTS (12 + OUTPUT_SHIFT_REGISTERS)
+
+// An output pin, resolved to one of the ports in the output port table and a bit mask
+struct OutputPin
+{
+  byte port;  // index in outputPorts
+  byte mask;  // 0 for an unused pin
+};
+
+struct OutputPort
+{
+  volatile uint8_t *reg;  // PORTx register, or the image of a shift register
+  byte mask;              // bits driven by the beacons
+  byte value;             // state of those bits at the next outputCommit()
+};
+
+extern OutputPort outputPorts[OUTPUT_MAX_PORTS];
+
+boolean outputAttachPin(int pin, OutputPin *dest);
+void outputCommit();
+
+/*!
+ * Set the next state of an output pin. Nothing changes on the pin until outputCommit() is called.
+ */
+inline void outputSet(const OutputPin &pin, byte level)
+{
+  if(level)
+  {
+    outputPorts[pin.port].value |= pin.mask;
+  }
+  else
+  {
+    outputPorts[pin.port].value &= ~pin.mask;
+  }
+}
+
+#endif
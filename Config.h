@@ -12,10 +12,77 @@
 //Max filename size for http requests
 #define HTTP_REQ_FILENAME_SZ   150
 
-// Number of beacons
+// The Mega has 8192 bytes of RAM. With the settings below, the larger tables take (in bytes):
+//   beacons (see Beacon in BeaconController.h)   612  BEACON_COUNT * 68
+//   beacon queues                                576  BEACON_COUNT * BEACON_QUEUE_LENGTH * BEACON_PART_SEGMENTS
+//   messages being compiled (see Scheduler.cpp)  684  BEACON_COUNT * (BEACON_MESSAGE_LENGTH + 32)
+//   schedule                                     768  SCHEDULE_ENTRIES * 12
+//   message pool                                 647  MESSAGE_POOL_SIZE + 45 * 3
+//   message texts and settings                   698  CONFIG_TEXT_SIZE + 45 * 6 + BEACON_MESSAGE_LENGTH
+//   loopback decoders                            576  BEACON_COUNT * 64
+//   log buffer                                   512  LOG_BUFFER_SIZE
+//   HTTP request                                 330  HTTP_REQ_BUF_SZ + HTTP_REQ_FILENAME_SZ
+//   sensor values                                240  SENSOR_COUNT * 2 * SENSOR_MORSE_LENGTH
+//   beacon interrupt statistics                  198  ENABLE_ISR_STATS
+//   power samples                                180  BEACON_COUNT * 20
+//   other variables                         about 500
+//   SD card (a 512 byte sector), ethernet, serial port and core    about 900
+// This leaves about 800 bytes for the stack. Check the total when a table grows.
+
+// Number of beacons. Every beacon takes about 415 bytes of RAM in the tables above, with its 4 default schedule
+// entries, so 9 is the most that fit. More only fit when other tables are made smaller (MESSAGE_POOL_SIZE,
+// LOG_BUFFER_SIZE, no ENABLE_ISR_STATS), and the limit below is raised after checking the budget again.
 #define BEACON_COUNT 9
+static_assert(BEACON_COUNT <= 9, "more beacons do not fit in the RAM of the Mega, see the budget above");
+// Beacon outputs on a chain of 74HC595 shift registers instead of Arduino pins (see BeaconOutput.h):
+// the number of registers in the chain, 0 for none. Beacon i then uses outputs 4i to 4i+3 (normal/inverted/PM0/PM1).
+// The chain is bit-banged on its own pins, because the SPI bus belongs to the ethernet and SD card.
+// OE is pulled high with a resistor and driven low once the chain holds a valid state.
+#define OUTPUT_SHIFT_REGISTERS 0
+#define OUTPUT_SHIFT_DATA_PIN  22
+#define OUTPUT_SHIFT_CLOCK_PIN 23
+#define OUTPUT_SHIFT_LATCH_PIN 24
+#define OUTPUT_SHIFT_OE_PIN    25
 // Maximum message length in characters
 #define BEACON_MESSAGE_LENGTH 44
+// Bytes of RAM for the message texts of all beacons, texts that do not fit are read from the SD card
+#define CONFIG_TEXT_SIZE 384
+// EEPROM address of the snapshot the beacons start from at power up, before the SD card is read (see ControlPanel.cpp)
+#define EEPROM_SNAPSHOT_ADDRESS 0
+// Bytes shared by the encoded messages of all beacons, identical messages are stored once.
+// Messages that do not fit are read from the SD card when they are sent.
+#define MESSAGE_POOL_SIZE 512
+// Schedule entries of all beacons together, 12 bytes of RAM each. A beacon can have up to SCHEDULE_BEACON_ENTRIES,
+// as many as fit in its record in BEACONS.BIN. See Scheduler.h
+#define SCHEDULE_ENTRIES 64
+#define SCHEDULE_BEACON_ENTRIES 32
+// Longest schedule entry on the web page, as in "H45 on 2026-10-17 12:00"
+#define SCHEDULE_TEXT_LENGTH 32
+// Rate of the beacon interrupt in Hz, every beacon derives its own dot length from it
+#define BEACON_TICK_RATE 1000
+// Timer1 counts at F_CPU / BEACON_TIMER_PRESCALER, one beacon tick is BEACON_TIMER_PERIOD counts (must be <65536)
+#define BEACON_TIMER_PRESCALER 64
+#define BEACON_TIMER_PERIOD (F_CPU / BEACON_TIMER_PRESCALER / BEACON_TICK_RATE)
+// Measure the beacon interrupt, see /isrstats.txt. Comment out to leave the measurements out.
+#define ENABLE_ISR_STATS
+// Rise and fall time of shaped keying (see KeyShaping.h), in Timer3 overflows of 128 us per step of the envelope.
+// 1 gives 32 steps in 4.1 ms.
+#define KEY_SHAPING_STEP_OVERFLOWS 1
+// Key-synchronized power sampling (see KeyedAdc.h): time from a key change to the sample, in microseconds.
+// Long enough for the transmitter and the detectors to settle, and shorter than a dot at the highest speed.
+#define KEYED_ADC_DELAY_US 5000
+// Loopback decoder (see Monitor.h): characters of decoded text kept per beacon, and the longest word it can check
+#define MONITOR_TEXT_LENGTH 16
+#define MONITOR_WORD_LENGTH 12
+// Keying speed in words per minute
+#define BEACON_MIN_WPM 6
+#define BEACON_MAX_WPM 40
+#define BEACON_DEFAULT_WPM 12
+// A message is compiled and queued in parts of this many segments, roughly 7 per character.
+// At least 16, room for the longest character.
+#define BEACON_PART_SEGMENTS 16
+// Number of parts that can be queued per beacon, including the one being sent (power of 2)
+#define BEACON_QUEUE_LENGTH 4
 
 // Physical limitations
 #define NUM_ANALOG_CHANNELS 16
@@ -25,5 +92,9 @@
 
 // Log interval in seconds
 #define LOG_INTERVAL 300
+// The log is written to the SD card a sector at a time (a multiple of 512). A record waits in RAM for at most
+// LOG_FLUSH_AGE seconds, and is lost if the power fails before then.
+#define LOG_BUFFER_SIZE 512
+#define LOG_FLUSH_AGE   3600
 
 #endif
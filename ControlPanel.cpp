@@ -2,22 +2,979 @@
 #include "Config.h"
 #include "BeaconController.h"
 #include "Sensors.h"
+#include "MessagePool.h"
+#include "DataLog.h"
 #include <Arduino.h>
 #include <SPI.h>
 #include <SD.h>
+#include <EEPROM.h>
 #include <TimeLib.h>
 #include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#include <util/crc16.h>
 
 extern Beacon beacons[BEACON_COUNT];
-static byte lastSpecialMessage[BEACON_COUNT]; // 0=H00, 1=H15, 2=H30, 3=H45
 
 static const char* msg_filenames[5] = { "H00", "H15", "H30", "H45", "DEF" };
 
-void controlPanelInit()
+// Encoded messages, so the scheduler does not have to go to the SD card and parse the text again
+// every time a beacon needs a message. Entries are dropped when the message or its enabled flag changes.
+// The messages themselves are kept in the message pool, where beacons with the same text share them.
+#define CACHE_VALID    0x01  // the entry reflects the SD card
+#define CACHE_SENDING  0x02  // the message is enabled and not empty
+#define CACHE_STREAMED 0x04  // the message is enabled but too long for the cache, see readBeaconMessage()
+struct CachedMessage
+{
+  byte flags;
+  byte message;  // id in the message pool, MESSAGE_POOL_NONE if there is none
+};
+static CachedMessage messageCache[BEACON_COUNT][BEACON_DEFMSG+1];
+// A message that does not fit in the pool any more is encoded here when it is needed
+static byte uncachedMessage[BEACON_MESSAGE_LENGTH];
+static int uncachedOwner = -1;  // beacon_nr * (BEACON_DEFMSG+1) + msg_index of the message in uncachedMessage
+
+// The settings of the messages are read from the SD card once, by controlPanelInit(), and kept here.
+// Changes are written to both. The texts are kept back to back in configTexts, without their terminating zero.
+// A text that does not fit is read from the SD card when it is needed.
+#define CONFIG_ENABLED 0x01  // the message is enabled
+#define CONFIG_IN_RAM  0x04  // the text is in configTexts
+#define CONFIG_LONG    0x08  // the default message is longer than a record text, see readBeaconMessage()
+struct MessageConfig
+{
+  byte flags;
+  byte length;      // of the text in configTexts
+  unsigned offset;  // of the text in configTexts
+};
+static MessageConfig messageConfig[BEACON_COUNT][BEACON_DEFMSG+1];
+static char configTexts[CONFIG_TEXT_SIZE];
+static unsigned configTextsEnd = 0;
+
+// Take a text out of configTexts, and move the texts after it down
+static void removeConfigText(MessageConfig &entry)
+{
+  if(!(entry.flags & CONFIG_IN_RAM))
+  {
+    return;
+  }
+  unsigned end = entry.offset + entry.length;
+  memmove(&configTexts[entry.offset], &configTexts[end], configTextsEnd - end);
+  configTextsEnd -= entry.length;
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    for(int j=0; j<=BEACON_DEFMSG; j++)
+    {
+      MessageConfig &other = messageConfig[i][j];
+      if((other.flags & CONFIG_IN_RAM) && (other.offset > entry.offset))
+      {
+        other.offset -= entry.length;
+      }
+    }
+  }
+  entry.flags &= ~CONFIG_IN_RAM;
+}
+
+// Replace the text of a message in configTexts, or leave it out if there is no room
+static void storeConfigText(MessageConfig &entry, const char *text)
+{
+  removeConfigText(entry);
+  size_t length = strlen(text);
+  if(configTextsEnd + length > CONFIG_TEXT_SIZE)
+  {
+    return;
+  }
+  memcpy(&configTexts[configTextsEnd], text, length);
+  entry.offset = configTextsEnd;
+  entry.length = length;
+  entry.flags |= CONFIG_IN_RAM;
+  configTextsEnd += length;
+}
+
+// Read the first line of a message file, at most bufsz-1 characters. Returns false if there is no file.
+static bool readMessageFile(int beacon_nr, int msg_index, char *dest, int bufsz, unsigned long *size)
 {
+  char filename[20];
   File f;
+  dest[0]=0;
+  sprintf(filename, "%d/%s.TXT", beacon_nr, msg_filenames[msg_index]);
+  f = SD.open(filename, FILE_READ);
+  if(!f)
+  {
+    return false;
+  }
+  *size = f.size();
+  char c = f.read();
+  while((c != -1) && (c != '\r') && (c != '\n') && (bufsz > 1))
+  {
+    *dest++=c;
+    bufsz--;
+    c=f.read();
+  }
+  *dest = 0;
+  f.close();
+  return true;
+}
+
+// All settings of a beacon are kept in BEACONS.BIN, in 2 records: a SettingsRecord with its state and texts, and a
+// ScheduleRecord. There are 2 copies of every record, in the two halves of a sector: beacon i has the copies of its
+// settings in sector 2i and those of its schedule in sector 2i+1. A change is written over the copy that is not
+// current, with the next generation number and a new CRC. At startup the copy with a good CRC and the highest
+// generation is used, so a write that is cut short by a power failure leaves the previous settings.
+// A record is too big to have on the stack, it is never read as a whole: fields are read where they are, and a change
+// is made by copying the current copy over the other one RECORD_CHUNK bytes at a time, with the new fields in place.
+// The SD library keeps one sector in memory, so with both copies in it a change costs one read and one write.
+// The only other file is N/DEF.TXT, for a default message that is too long for the record.
+#define CONFIG_FILENAME       "BEACONS.BIN"
+#define RECORD_SIZE           256
+#define RECORD_CHUNK          64
+#define RECORD_SETTINGS       0
+#define RECORD_SCHEDULE       1
+#define RECORD_MAGIC_SETTINGS 0xBC03
+#define RECORD_MAGIC_SCHEDULE 0xBC04
+#define RECORD_RUNNING        0x01
+#define RECORD_DEF_LONG       0x02  // the default message is in N/DEF.TXT, the record has its start
+struct RecordHeader
+{
+  uint16_t magic;
+  uint16_t crc;              // CRC-16 (CCITT) of the rest of the record
+  uint32_t generation;
+};
+struct SettingsRecord
+{
+  uint16_t magic;
+  uint16_t crc;
+  uint32_t generation;
+  byte flags;
+  byte wpm;
+  byte enabled;              // bit i: message i is enabled
+  char texts[BEACON_DEFMSG+1][BEACON_MESSAGE_LENGTH];
+};
+struct ScheduleRecord
+{
+  uint16_t magic;
+  uint16_t crc;
+  uint32_t generation;
+  byte scheduleCount;
+  ScheduleEntry schedule[SCHEDULE_BEACON_ENTRIES];
+};
+static_assert(sizeof(SettingsRecord) <= RECORD_SIZE, "both copies of the settings must fit in a sector");
+static_assert(sizeof(ScheduleRecord) <= RECORD_SIZE, "both copies of the schedule must fit in a sector");
+static_assert(offsetof(SettingsRecord, flags) == sizeof(RecordHeader), "a record starts with its header");
+static_assert(offsetof(ScheduleRecord, scheduleCount) == sizeof(RecordHeader), "a record starts with its header");
+
+// Earlier versions kept a whole BeaconRecord in CONFIG.BIN, with a sector for every copy. Beacons that have no
+// records yet get them from there. Records of the first version end before the schedule.
+#define OLD_CONFIG_FILENAME "CONFIG.BIN"
+#define OLD_RECORD_SIZE     512
+#define OLD_RECORD_MAGIC    0xBC02
+#define OLD_RECORD_MAGIC_V1 0xBC01
+#define OLD_RECORD_V1_SIZE  offsetof(OldBeaconRecord, scheduleCount)
+struct OldBeaconRecord
+{
+  uint16_t magic;
+  uint16_t crc;
+  uint32_t generation;
+  byte flags;
+  byte wpm;
+  byte enabled;
+  char texts[BEACON_DEFMSG+1][BEACON_MESSAGE_LENGTH];
+  byte scheduleCount;
+  ScheduleEntry schedule[SCHEDULE_BEACON_ENTRIES];
+};
+static_assert(offsetof(OldBeaconRecord, texts) == offsetof(SettingsRecord, texts), "old settings are copied as they are");
+
+// A field of a record and its new value
+struct RecordChange
+{
+  size_t offset;
+  const void *data;
+  size_t size;
+};
+
+static byte recordCopy[BEACON_COUNT];            // bit r: copy 1 of record r is current
+static uint32_t recordGeneration[BEACON_COUNT];  // the highest generation of the records, 0 if the beacon has none
+
+static unsigned long recordPosition(int beacon_nr, byte record, byte copy)
+{
+  return ((2UL * beacon_nr + record) * 2 + copy) * RECORD_SIZE;
+}
+
+static unsigned long currentRecordPosition(int beacon_nr, byte record)
+{
+  return recordPosition(beacon_nr, record, (recordCopy[beacon_nr] >> record) & 1);
+}
+
+static uint16_t recordMagic(byte record)
+{
+  return (record == RECORD_SETTINGS) ? RECORD_MAGIC_SETTINGS : RECORD_MAGIC_SCHEDULE;
+}
+
+// The size of a record with this magic, 0 for no record
+static size_t recordSize(uint16_t magic)
+{
+  switch(magic)
+  {
+    case RECORD_MAGIC_SETTINGS:
+      return sizeof(SettingsRecord);
+    case RECORD_MAGIC_SCHEDULE:
+      return sizeof(ScheduleRecord);
+    case OLD_RECORD_MAGIC:
+      return sizeof(OldBeaconRecord);
+    case OLD_RECORD_MAGIC_V1:
+      return OLD_RECORD_V1_SIZE;
+  }
+  return 0;
+}
+
+static bool readField(File &f, unsigned long pos, size_t offset, void *dest, size_t size)
+{
+  return f.seek(pos + offset) && (f.read(dest, size) == (int)size);
+}
+
+static uint16_t crcUpdate(uint16_t crc, const byte *data, size_t size)
+{
+  for(size_t i = 0; i < size; i++)
+  {
+    crc = _crc_ccitt_update(crc, data[i]);
+  }
+  return crc;
+}
+
+// Check the CRC of a copy of a record, a chunk at a time. Returns its magic, 0 if the copy is not good.
+static uint16_t checkRecordCopy(File &f, unsigned long pos, uint32_t *generation)
+{
+  RecordHeader h;
+  byte buf[RECORD_CHUNK];
+  byte count = 0;
+  size_t end;
+  if(!readField(f, pos, 0, &h, sizeof(h)) || ((end = recordSize(h.magic)) == 0))
+  {
+    return 0;
+  }
+  *generation = h.generation;
+  size_t countAt = (h.magic == RECORD_MAGIC_SCHEDULE) ? offsetof(ScheduleRecord, scheduleCount) :
+                   (h.magic == OLD_RECORD_MAGIC) ? offsetof(OldBeaconRecord, scheduleCount) : 0;
+  uint16_t crc = crcUpdate(0xFFFF, (const byte *)&h.generation, sizeof(h.generation));
+  for(size_t at = sizeof(h); at < end; at += sizeof(buf))
+  {
+    size_t n = (end - at < sizeof(buf)) ? end - at : sizeof(buf);
+    if(f.read(buf, n) != (int)n)
+    {
+      return 0;
+    }
+    if(countAt && (at <= countAt) && (countAt < at + n))
+    {
+      count = buf[countAt - at];
+    }
+    crc = crcUpdate(crc, buf, n);
+  }
+  return ((crc == h.crc) && (count <= SCHEDULE_BEACON_ENTRIES)) ? h.magic : 0;
+}
+
+// Make the copy of a record with a good CRC and the highest generation current
+static bool findRecord(File &f, int beacon_nr, byte record)
+{
+  bool found = false;
+  uint32_t best = 0;
+  for(byte copy=0; copy<2; copy++)
+  {
+    uint32_t generation;
+    if((checkRecordCopy(f, recordPosition(beacon_nr, record, copy), &generation) == recordMagic(record)) &&
+       (!found || (generation > best)))
+    {
+      found = true;
+      best = generation;
+      recordCopy[beacon_nr] = (recordCopy[beacon_nr] & ~(1 << record)) | (copy << record);
+    }
+  }
+  if(found && (best > recordGeneration[beacon_nr]))
+  {
+    recordGeneration[beacon_nr] = best;
+  }
+  return found;
+}
+
+// Read a field of the current copy of a record of a beacon
+static bool readRecordField(int beacon_nr, byte record, size_t offset, void *dest, size_t size)
+{
+  File f = SD.open(CONFIG_FILENAME, FILE_READ);
+  bool ok = f && (recordGeneration[beacon_nr] != 0) &&
+            readField(f, currentRecordPosition(beacon_nr, record), offset, dest, size);
+  if(f)
+  {
+    f.close();
+  }
+  if(!ok)
+  {
+    Serial.print(F("Can not read the settings of beacon nr "));
+    Serial.println(beacon_nr);
+  }
+  return ok;
+}
+
+// A new file, or more beacons than before: the file grows up to the position, with zeros
+static bool growFile(File &f, unsigned long pos)
+{
+  bool ok = true;
+  if(f.size() < pos)
+  {
+    f.seek(f.size());
+    while(ok && (f.position() < pos))
+    {
+      ok = (f.write((uint8_t)0) == 1);
+    }
+  }
+  return ok;
+}
+
+// Write the copy of a record of a beacon that is not current, then make it current. The record is copied from
+// the one at srcPos in src, or starts with zeros if there is no src, with the changes made. The header goes last,
+// so a copy that is cut short has a wrong magic or CRC.
+static bool copyRecord(int beacon_nr, byte record, File &f, File *src, unsigned long srcPos,
+                       const RecordChange *changes, byte count)
+{
+  RecordHeader h;
+  byte buf[RECORD_CHUNK];
+  byte copy = ((recordCopy[beacon_nr] >> record) & 1) ^ 1;
+  unsigned long pos = recordPosition(beacon_nr, record, copy);
+  size_t size = recordSize(recordMagic(record));
+  h.magic = recordMagic(record);
+  h.generation = recordGeneration[beacon_nr] + 1;
+  h.crc = crcUpdate(0xFFFF, (const byte *)&h.generation, sizeof(h.generation));
+  bool ok = growFile(f, pos + sizeof(h));  // the body is written after the place of the header
+  for(size_t at = sizeof(h); ok && (at < size); at += sizeof(buf))
+  {
+    size_t n = (size - at < sizeof(buf)) ? size - at : sizeof(buf);
+    if(src)
+    {
+      ok = readField(*src, srcPos, at, buf, n);
+    }
+    else
+    {
+      memset(buf, 0, n);
+    }
+    for(byte i = 0; i < count; i++)
+    {
+      // The part of the change that falls in this chunk
+      size_t from = (changes[i].offset > at) ? changes[i].offset : at;
+      size_t to = changes[i].offset + changes[i].size;
+      if(to > at + n)
+      {
+        to = at + n;
+      }
+      if(from < to)
+      {
+        memcpy(&buf[from - at], (const byte *)changes[i].data + (from - changes[i].offset), to - from);
+      }
+    }
+    h.crc = crcUpdate(h.crc, buf, n);
+    ok = ok && f.seek(pos + at) && (f.write(buf, n) == n);
+  }
+  ok = ok && f.seek(pos) && (f.write((const uint8_t *)&h, sizeof(h)) == sizeof(h));
+  f.flush();
+  if(!ok)
+  {
+    Serial.println(F("Can not write " CONFIG_FILENAME));
+    return false;
+  }
+  recordCopy[beacon_nr] = (recordCopy[beacon_nr] & ~(1 << record)) | (copy << record);
+  recordGeneration[beacon_nr] = h.generation;
+  return true;
+}
+
+// Change fields of a record of a beacon
+static bool changeRecord(int beacon_nr, byte record, const RecordChange *changes, byte count)
+{
+  if(recordGeneration[beacon_nr] == 0)
+  {
+    Serial.print(F("Can not read the settings of beacon nr "));
+    Serial.println(beacon_nr);
+    return false;
+  }
+  File f = SD.open(CONFIG_FILENAME, O_READ | O_WRITE | O_CREAT);
+  if(!f)
+  {
+    Serial.println(F("Can not write " CONFIG_FILENAME));
+    return false;
+  }
+  bool ok = copyRecord(beacon_nr, record, f, &f, currentRecordPosition(beacon_nr, record), changes, count);
+  f.close();
+  return ok;
+}
+
+static bool changeRecordField(int beacon_nr, byte record, size_t offset, const void *data, size_t size)
+{
+  RecordChange change = {offset, data, size};
+  return changeRecord(beacon_nr, record, &change, 1);
+}
+
+// Give a beacon the default schedule, for a new beacon or one with a record of the first version
+static bool writeDefaultSchedule(int beacon_nr, File &f)
+{
+  ScheduleEntry schedule[SCHEDULE_BEACON_ENTRIES];
+  byte count = scheduleDefault(schedule);
+  RecordChange changes[] =
+  {
+    {offsetof(ScheduleRecord, scheduleCount), &count, 1},
+    {offsetof(ScheduleRecord, schedule), schedule, count * sizeof(ScheduleEntry)}
+  };
+  return copyRecord(beacon_nr, RECORD_SCHEDULE, f, NULL, 0, changes, 2);
+}
+
+// Make the records of a beacon from its record in CONFIG.BIN, if it has a good one there. The schedule goes first:
+// a beacon that has its settings has its schedule too.
+static bool readOldRecord(int beacon_nr, File &f)
+{
+  uint16_t magic = 0;
+  unsigned long pos = 0;
+  uint32_t best = 0;
+  File old = SD.open(OLD_CONFIG_FILENAME, FILE_READ);
+  for(byte copy=0; old && (copy<2); copy++)
+  {
+    uint32_t generation;
+    unsigned long at = (2UL * beacon_nr + copy) * OLD_RECORD_SIZE;
+    uint16_t m = checkRecordCopy(old, at, &generation);
+    if(((m == OLD_RECORD_MAGIC) || (m == OLD_RECORD_MAGIC_V1)) && (!magic || (generation > best)))
+    {
+      magic = m;
+      pos = at;
+      best = generation;
+    }
+  }
+  // The schedule is copied from where it starts in the old record, the settings are where they were
+  unsigned long schedulePos = pos + offsetof(OldBeaconRecord, scheduleCount) - offsetof(ScheduleRecord, scheduleCount);
+  bool ok = magic &&
+            ((magic == OLD_RECORD_MAGIC_V1) ? writeDefaultSchedule(beacon_nr, f) :
+             copyRecord(beacon_nr, RECORD_SCHEDULE, f, &old, schedulePos, NULL, 0)) &&
+            copyRecord(beacon_nr, RECORD_SETTINGS, f, &old, pos, NULL, 0);
+  if(old)
+  {
+    old.close();
+  }
+  return ok;
+}
+
+// Make the settings of a beacon from the files of older versions: N/ON, N/WPM, N/H00.TXT, N/H00.ON and so on
+static bool readOldFiles(int beacon_nr, File &f)
+{
   char filename[20];
-  byte firstMessage;
+  char text[BEACON_MESSAGE_LENGTH];
+  File old;
+  unsigned long size;
+  byte flags = 0;
+  byte wpm = BEACON_DEFAULT_WPM;
+  byte enabled = 0;
+  sprintf(filename, "%d", beacon_nr);
+  bool found = SD.exists(filename);
+  if(!found)
+  {
+    flags = RECORD_RUNNING;  // A new beacon
+  }
+  sprintf(filename, "%d/ON", beacon_nr);
+  if(found && SD.exists(filename))
+  {
+    flags |= RECORD_RUNNING;
+  }
+  sprintf(filename, "%d/WPM", beacon_nr);
+  old = found ? SD.open(filename, FILE_READ) : File();
+  if(old)
+  {
+    wpm = old.parseInt();
+    old.close();
+  }
+  for(int j=0; found && (j<=BEACON_DEFMSG); j++)
+  {
+    sprintf(filename, "%d/%s.ON", beacon_nr, msg_filenames[j]);
+    if(SD.exists(filename))
+    {
+      enabled |= 1 << j;
+    }
+  }
+  if(found && readMessageFile(beacon_nr, BEACON_DEFMSG, text, BEACON_MESSAGE_LENGTH, &size) &&
+     (size > BEACON_MESSAGE_LENGTH + 1))
+  {
+    flags |= RECORD_DEF_LONG;
+  }
+  RecordChange changes[] =
+  {
+    {offsetof(SettingsRecord, flags), &flags, 1},
+    {offsetof(SettingsRecord, wpm), &wpm, 1},
+    {offsetof(SettingsRecord, enabled), &enabled, 1}
+  };
+  if(!copyRecord(beacon_nr, RECORD_SETTINGS, f, NULL, 0, changes, 3))
+  {
+    return false;
+  }
+  // The texts one at a time, there is no room for all of them at once
+  for(int j=0; found && (j<=BEACON_DEFMSG); j++)
+  {
+    memset(text, 0, sizeof(text));
+    if(readMessageFile(beacon_nr, j, text, BEACON_MESSAGE_LENGTH, &size) && text[0])
+    {
+      RecordChange change = {offsetof(SettingsRecord, texts) + j * BEACON_MESSAGE_LENGTH, text, sizeof(text)};
+      if(!copyRecord(beacon_nr, RECORD_SETTINGS, f, &f, currentRecordPosition(beacon_nr, RECORD_SETTINGS), &change, 1))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Take the settings of a beacon from the current copies of its records
+static void applyRecord(int beacon_nr, File &f)
+{
+  byte flags;
+  byte wpm;
+  byte enabled;
+  byte count;
+  char text[BEACON_MESSAGE_LENGTH];
+  ScheduleEntry schedule[SCHEDULE_BEACON_ENTRIES];
+  unsigned long pos = currentRecordPosition(beacon_nr, RECORD_SETTINGS);
+  unsigned long schedulePos = currentRecordPosition(beacon_nr, RECORD_SCHEDULE);
+  if((recordGeneration[beacon_nr] == 0) ||
+     !readField(f, pos, offsetof(SettingsRecord, flags), &flags, 1) ||
+     !readField(f, pos, offsetof(SettingsRecord, wpm), &wpm, 1) ||
+     !readField(f, pos, offsetof(SettingsRecord, enabled), &enabled, 1) ||
+     !readField(f, schedulePos, offsetof(ScheduleRecord, scheduleCount), &count, 1) ||
+     (count > SCHEDULE_BEACON_ENTRIES) ||
+     !readField(f, schedulePos, offsetof(ScheduleRecord, schedule), schedule, count * sizeof(ScheduleEntry)))
+  {
+    Serial.print(F("Can not read the settings of beacon nr "));
+    Serial.println(beacon_nr);
+    return;
+  }
+  beacons[beacon_nr].setEnabled(flags & RECORD_RUNNING);
+  beacons[beacon_nr].setSpeed(wpm);
+  for(int j=0; j<=BEACON_DEFMSG; j++)
+  {
+    MessageConfig &entry = messageConfig[beacon_nr][j];
+    removeConfigText(entry);
+    entry.flags = 0;
+    if(enabled & (1 << j))
+    {
+      entry.flags |= CONFIG_ENABLED;
+    }
+    if((j == BEACON_DEFMSG) && (flags & RECORD_DEF_LONG))
+    {
+      entry.flags |= CONFIG_LONG;
+    }
+    if(!readField(f, pos, offsetof(SettingsRecord, texts) + j * BEACON_MESSAGE_LENGTH, text, sizeof(text)))
+    {
+      text[0] = 0;
+    }
+    text[sizeof(text) - 1] = 0;
+    storeConfigText(entry, text);
+  }
+  if(!schedulerSetEntries(beacon_nr, schedule, count))
+  {
+    Serial.print(F("No room for the schedule of beacon nr "));
+    Serial.println(beacon_nr);
+  }
+}
+
+// What every beacon sends by default is also kept in EEPROM, already encoded, so the beacons can start right after
+// a reset while the SD card, the network and the sensors come up. One entry per beacon, with a CRC of its own.
+// Written with EEPROM.put(), which only writes the bytes that changed.
+#define SNAPSHOT_MAGIC   0x5B01
+#define SNAPSHOT_RUNNING 0x01
+#define SNAPSHOT_SENDING 0x02  // the entry has the default message, not for a disabled, empty or streamed one
+struct SnapshotEntry
+{
+  uint16_t magic;
+  uint16_t crc;              // CRC-16 (CCITT) of the rest of the entry
+  byte flags;
+  byte wpm;
+  byte message[BEACON_MESSAGE_LENGTH];  // the default message, as encoded by morseEncodeMessage()
+};
+static_assert(EEPROM_SNAPSHOT_ADDRESS + BEACON_COUNT * sizeof(SnapshotEntry) <= E2END + 1, "the snapshot must fit in the EEPROM");
+
+static uint16_t snapshotCrc(const SnapshotEntry &s)
+{
+  uint16_t crc = 0xFFFF;
+  const byte *data = (const byte *)&s;
+  for(size_t i = offsetof(SnapshotEntry, flags); i < sizeof(SnapshotEntry); i++)
+  {
+    crc = _crc_ccitt_update(crc, data[i]);
+  }
+  return crc;
+}
+
+// Bring the snapshot of a beacon in line with its settings. Reads the default message, if it is not in memory.
+static void updateSnapshot(int beacon_nr)
+{
+  SnapshotEntry s;
+  memset(&s, 0, sizeof(s));
+  s.magic = SNAPSHOT_MAGIC;
+  s.flags = beacons[beacon_nr].getEnabled() ? SNAPSHOT_RUNNING : 0;
+  s.wpm = beacons[beacon_nr].getSpeed();
+  const byte *encoded = getEncodedBeaconMessage(beacon_nr, BEACON_DEFMSG);
+  if(encoded)
+  {
+    s.flags |= SNAPSHOT_SENDING;
+    memcpy(s.message, encoded, morseEncodedLength(encoded));
+  }
+  s.crc = snapshotCrc(s);
+  EEPROM.put(EEPROM_SNAPSHOT_ADDRESS + beacon_nr * sizeof(SnapshotEntry), s);
+}
+
+static void dropCachedMessage(int beacon_nr, int msg_index)
+{
+  CachedMessage &entry = messageCache[beacon_nr][msg_index];
+  if(uncachedOwner == beacon_nr * (BEACON_DEFMSG+1) + msg_index)
+  {
+    uncachedOwner = -1;
+  }
+  if(entry.message != MESSAGE_POOL_NONE)
+  {
+    messagePoolRelease(entry.message);
+    entry.message = MESSAGE_POOL_NONE;
+  }
+  entry.flags = 0;
+}
+
+// Changes to several beacons at once are collected in CONFIG.NEW first: a header, then the new records of every
+// beacon that changes, RECORD_SIZE bytes each, those of beacon i at 2i+1 and 2i+2. Nothing changes until the batch
+// is complete. Then the header is marked complete and the records are written to BEACONS.BIN. A complete batch that
+// was cut short by a power failure is finished at the next start, an incomplete one is dropped.
+#define BATCH_FILENAME "CONFIG.NEW"
+#define BATCH_MAGIC    0xBA7C
+struct BatchHeader
+{
+  uint16_t magic;  // BATCH_MAGIC once the batch is complete
+  uint16_t crc;    // CRC-16 (CCITT) of staged
+  byte staged[(BEACON_COUNT + 7) / 8];  // bit i: beacon i has new records
+};
+static File batchFile;     // open while a batch is collected
+static BatchHeader batch;
+
+static unsigned long batchPosition(int beacon_nr, byte record)
+{
+  return (1UL + 2 * beacon_nr + record) * RECORD_SIZE;
+}
+
+static uint16_t batchCrc(const BatchHeader &h)
+{
+  uint16_t crc = 0xFFFF;
+  for(size_t i = 0; i < sizeof(h.staged); i++)
+  {
+    crc = _crc_ccitt_update(crc, h.staged[i]);
+  }
+  return crc;
+}
+
+static bool isStaged(const BatchHeader &h, int beacon_nr)
+{
+  return (h.staged[beacon_nr / 8] & (1 << (beacon_nr % 8))) != 0;
+}
+
+// Write the records of a complete batch to BEACONS.BIN and use them. The batch is removed when all is written.
+static bool runBatch()
+{
+  BatchHeader h;
+  bool ok = true;
+  File f = SD.open(BATCH_FILENAME, FILE_READ);
+  if(!f)
+  {
+    return false;
+  }
+  File config = SD.open(CONFIG_FILENAME, O_READ | O_WRITE | O_CREAT);
+  if(!config)
+  {
+    Serial.println(F("Can not write " CONFIG_FILENAME));
+    f.close();
+    return false;  // The batch is kept for the next start
+  }
+  if((f.read(&h, sizeof(h)) == sizeof(h)) && (h.magic == BATCH_MAGIC) && (h.crc == batchCrc(h)))
+  {
+    for(int i=0; i<BEACON_COUNT; i++)
+    {
+      if(!isStaged(h, i))
+      {
+        continue;
+      }
+      if(!copyRecord(i, RECORD_SCHEDULE, config, &f, batchPosition(i, RECORD_SCHEDULE), NULL, 0) ||
+         !copyRecord(i, RECORD_SETTINGS, config, &f, batchPosition(i, RECORD_SETTINGS), NULL, 0))
+      {
+        ok = false;
+        continue;
+      }
+      applyRecord(i, config);
+      for(int j=0; j<=BEACON_DEFMSG; j++)
+      {
+        dropCachedMessage(i, j);
+      }
+      updateSnapshot(i);
+    }
+  }
+  else
+  {
+    ok = false;  // Not complete: nothing happens
+  }
+  config.close();
+  f.close();
+  SD.remove(BATCH_FILENAME);
+  return ok;
+}
+
+// Make sure the batch has the records of the beacon. The first change of a beacon starts from its current records.
+static bool batchStage(int beacon_nr)
+{
+  byte buf[RECORD_CHUNK];
+  if(!batchFile || (beacon_nr<0) || (beacon_nr>=BEACON_COUNT))
+  {
+    return false;
+  }
+  if(isStaged(batch, beacon_nr))
+  {
+    return true;
+  }
+  if(recordGeneration[beacon_nr] == 0)
+  {
+    return false;
+  }
+  File f = SD.open(CONFIG_FILENAME, FILE_READ);
+  bool ok = f;
+  for(byte record=0; ok && (record<2); record++)
+  {
+    unsigned long pos = batchPosition(beacon_nr, record);
+    size_t size = recordSize(recordMagic(record));
+    ok = growFile(batchFile, pos);
+    for(size_t at = 0; ok && (at < size); at += sizeof(buf))
+    {
+      size_t n = (size - at < sizeof(buf)) ? size - at : sizeof(buf);
+      ok = readField(f, currentRecordPosition(beacon_nr, record), at, buf, n) && batchFile.seek(pos + at) &&
+           (batchFile.write(buf, n) == n);
+    }
+  }
+  if(f)
+  {
+    f.close();
+  }
+  if(!ok)
+  {
+    return false;
+  }
+  batch.staged[beacon_nr / 8] |= 1 << (beacon_nr % 8);
+  return true;
+}
+
+static bool batchWrite(int beacon_nr, byte record, size_t offset, const void *data, size_t size)
+{
+  return batchStage(beacon_nr) && batchFile.seek(batchPosition(beacon_nr, record) + offset) &&
+         (batchFile.write((const uint8_t *)data, size) == size);
+}
+
+static bool batchRead(int beacon_nr, byte record, size_t offset, void *data, size_t size)
+{
+  return batchStage(beacon_nr) && batchFile.seek(batchPosition(beacon_nr, record) + offset) &&
+         (batchFile.read(data, size) == (int)size);
+}
+
+/*!
+ * Start collecting changes to the settings of the beacons, to be made all at once with configBatchCommit().
+ * The configBatch...() calls return false if the change can not be written to the SD card.
+ */
+bool configBatchBegin()
+{
+  configBatchAbort();
+  memset(&batch, 0, sizeof(batch));
+  batchFile = SD.open(BATCH_FILENAME, O_READ | O_WRITE | O_CREAT);
+  if(!batchFile || (batchFile.write((const uint8_t *)&batch, sizeof(batch)) != sizeof(batch)))
+  {
+    Serial.println(F("Can not write " BATCH_FILENAME));
+    configBatchAbort();
+    return false;
+  }
+  return true;
+}
+
+bool configBatchRunning(int beacon_nr, bool running)
+{
+  byte flags;
+  if(!batchRead(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1))
+  {
+    return false;
+  }
+  flags = running ? (flags | RECORD_RUNNING) : (flags & ~RECORD_RUNNING);
+  return batchWrite(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1);
+}
+
+bool configBatchSpeed(int beacon_nr, byte wpm)
+{
+  return batchWrite(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, wpm), &wpm, 1);
+}
+
+/*!
+ * Change the text of a message. The text has to fit in BEACON_MESSAGE_LENGTH, with its terminating zero.
+ */
+bool configBatchMessage(int beacon_nr, int msg_index, const char *text)
+{
+  char dest[BEACON_MESSAGE_LENGTH];
+  byte flags;
+  if((msg_index<0) || (msg_index>BEACON_DEFMSG) || (strlen(text) >= BEACON_MESSAGE_LENGTH))
+  {
+    return false;
+  }
+  // The record keeps the first line, as setBeaconMessage() does
+  memset(dest, 0, sizeof(dest));
+  memcpy(dest, text, strcspn(text, "\r\n"));
+  if(msg_index == BEACON_DEFMSG)
+  {
+    // Replaces a default message that was too long for the record
+    if(!batchRead(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1))
+    {
+      return false;
+    }
+    flags &= ~RECORD_DEF_LONG;
+    if(!batchWrite(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1))
+    {
+      return false;
+    }
+  }
+  return batchWrite(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, texts) + msg_index * BEACON_MESSAGE_LENGTH, dest, sizeof(dest));
+}
+
+bool configBatchEnabled(int beacon_nr, int msg_index, bool enabled)
+{
+  byte bits;
+  if((msg_index<0) || (msg_index>BEACON_DEFMSG) || !batchRead(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, enabled), &bits, 1))
+  {
+    return false;
+  }
+  bits = enabled ? (bits | (1 << msg_index)) : (bits & ~(1 << msg_index));
+  return batchWrite(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, enabled), &bits, 1);
+}
+
+/*!
+ * Set an entry of the schedule of a beacon, checked with scheduleValid(). configBatchScheduleLength() sets
+ * the number of entries.
+ */
+bool configBatchScheduleEntry(int beacon_nr, byte index, const ScheduleEntry &entry)
+{
+  return (index < SCHEDULE_BEACON_ENTRIES) &&
+         batchWrite(beacon_nr, RECORD_SCHEDULE, offsetof(ScheduleRecord, schedule) + index * sizeof(ScheduleEntry), &entry, sizeof(entry));
+}
+
+bool configBatchScheduleLength(int beacon_nr, byte count)
+{
+  return (count <= SCHEDULE_BEACON_ENTRIES) && batchWrite(beacon_nr, RECORD_SCHEDULE, offsetof(ScheduleRecord, scheduleCount), &count, 1);
+}
+
+/*!
+ * Make all changes of the batch
+ *
+ * \return false if nothing changed: the schedules do not fit in SCHEDULE_ENTRIES together, or the batch can
+ *         not be written. Also false if only a part of the changes could be written.
+ */
+bool configBatchCommit()
+{
+  unsigned entries = 0;
+  if(!batchFile)
+  {
+    return false;
+  }
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    byte count = schedulerEntryCount(i);
+    if(isStaged(batch, i) && !batchRead(i, RECORD_SCHEDULE, offsetof(ScheduleRecord, scheduleCount), &count, 1))
+    {
+      configBatchAbort();
+      return false;
+    }
+    entries += count;
+  }
+  if(entries > SCHEDULE_ENTRIES)
+  {
+    Serial.println(F("No room for the schedules"));
+    configBatchAbort();
+    return false;
+  }
+  batch.magic = BATCH_MAGIC;
+  batch.crc = batchCrc(batch);
+  bool ok = batchFile.seek(0) && (batchFile.write((const uint8_t *)&batch, sizeof(batch)) == sizeof(batch));
+  batchFile.close();
+  if(!ok)
+  {
+    Serial.println(F("Can not write " BATCH_FILENAME));
+    SD.remove(BATCH_FILENAME);
+    return false;
+  }
+  return runBatch();
+}
+
+/*!
+ * Forget the changes of the batch
+ */
+void configBatchAbort()
+{
+  if(batchFile)
+  {
+    batchFile.close();
+  }
+  SD.remove(BATCH_FILENAME);
+}
+
+/*!
+ * Start the beacons from the snapshot in EEPROM, with the speed and default message they had before the reset.
+ * Needs neither the SD card nor the network, so the beacons can be keying within milliseconds. Until controlPanelInit()
+ * the slot messages are not sent, and a beacon without a good snapshot keeps still.
+ * Call after the beacons are started with Beacon::begin(), and before the scheduler.
+ *
+ * \return the number of beacons that were restored
+ */
+int controlPanelRestore()
+{
+  SnapshotEntry s;
+  int restored = 0;
+  messagePoolInit();
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    // Valid entries, so nothing tries the SD card yet
+    for(int j=0; j<=BEACON_DEFMSG; j++)
+    {
+      messageCache[i][j].flags = CACHE_VALID;
+      messageCache[i][j].message = MESSAGE_POOL_NONE;
+      messageConfig[i][j].flags = 0;
+    }
+    EEPROM.get(EEPROM_SNAPSHOT_ADDRESS + i * sizeof(SnapshotEntry), s);
+    if((s.magic != SNAPSHOT_MAGIC) || (s.crc != snapshotCrc(s)))
+    {
+      continue;
+    }
+    if(s.flags & SNAPSHOT_SENDING)
+    {
+      CachedMessage &entry = messageCache[i][BEACON_DEFMSG];
+      entry.message = messagePoolAdd(s.message);
+      if(entry.message != MESSAGE_POOL_NONE)
+      {
+        entry.flags |= CACHE_SENDING;
+      }
+    }
+    beacons[i].setSpeed(s.wpm);
+    beacons[i].setEnabled(s.flags & SNAPSHOT_RUNNING);
+    restored++;
+  }
+  return restored;
+}
+
+// The beacons run while controlPanelInit() reads the SD card, and loop() does not refill their queues yet.
+// The changes to the open BEACONS.BIN are written first, a streamed message may be read from it.
+static void refillQueues(File &f)
+{
+  if(f)
+  {
+    f.flush();
+  }
+  schedulerTick();
+}
+
+/*!
+ * Start the SD card and load the settings of all beacons. Call after controlPanelRestore() and schedulerInit():
+ * the queues of the beacons are refilled in between the slow steps.
+ */
+void controlPanelInit()
+{
   pinMode(10, OUTPUT);
   digitalWrite(10, HIGH);
 
@@ -28,27 +985,55 @@ void controlPanelInit()
   }
   Serial.println("SCDCard initialization done.");
 
-  firstMessage = minute()/15;
+  File f = SD.open(CONFIG_FILENAME, O_READ | O_WRITE | O_CREAT);
   for(int i=0; i<BEACON_COUNT; i++)
   {
-    lastSpecialMessage[i]=firstMessage;
-    sprintf(filename, "%d", i);
-    if(!SD.exists(filename))
+    refillQueues(f);
+    // The messages of the snapshot make way for the settings, those of the other beacons are still sent
+    for(int j=0; j<=BEACON_DEFMSG; j++)
     {
-      SD.mkdir(filename);
-      sprintf(filename, "%d/ON", i);
-      f = SD.open(filename, FILE_WRITE);
-      f.close();
+      dropCachedMessage(i, j);
+      messageConfig[i][j].flags = 0;
     }
-    sprintf(filename, "%d/ON", i);
-    if(SD.exists(filename))
+    recordCopy[i] = 0;
+    recordGeneration[i] = 0;
+    if(!f)
     {
-      beacons[i].setEnabled(true);
+      Serial.println(F("Can not write " CONFIG_FILENAME));
+      continue;
     }
-    else
+    // Beacons without records yet get them, from CONFIG.BIN or the files of older versions if they are there
+    bool settings = findRecord(f, i, RECORD_SETTINGS);
+    bool schedule = findRecord(f, i, RECORD_SCHEDULE);
+    if(!settings && readOldRecord(i, f))
+    {
+      settings = schedule = true;
+    }
+    if(!settings)
+    {
+      settings = readOldFiles(i, f);
+    }
+    if(settings && !schedule)
+    {
+      settings = writeDefaultSchedule(i, f);
+    }
+    if(!settings)
     {
-      beacons[i].setEnabled(false);
+      recordGeneration[i] = 0;
     }
+    applyRecord(i, f);
+  }
+  if(f)
+  {
+    f.close();
+  }
+  schedulerTick();
+  // A batch of changes that was not finished
+  runBatch();
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    schedulerTick();
+    updateSnapshot(i);
   }
   if(!SD.exists("/log"))
   {
@@ -67,47 +1052,76 @@ bool isBeaconRunning(int beacon_nr)
 
 void setBeaconRunning(int beacon_nr, bool state)
 {
-  File f;
-  char filename[20];
-  
+  byte flags;
   if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT))
   {
-    sprintf(filename, "%d/ON", beacon_nr);
     beacons[beacon_nr].setEnabled(state);
-    if(state)
-    {
-      f = SD.open(filename, FILE_WRITE);
-      f.close();
-    }
-    else
+    if(readRecordField(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1))
     {
-      SD.remove(filename);
+      flags = state ? (flags | RECORD_RUNNING) : (flags & ~RECORD_RUNNING);
+      changeRecordField(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1);
     }
+    updateSnapshot(beacon_nr);
   }
 }
 
+byte getBeaconSpeed(int beacon_nr)
+{
+  if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT))
+  {
+    return beacons[beacon_nr].getSpeed();
+  }
+  return 0;
+}
+
+void setBeaconSpeed(int beacon_nr, byte wpm)
+{
+  if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT))
+  {
+    beacons[beacon_nr].setSpeed(wpm);
+    wpm = beacons[beacon_nr].getSpeed();
+    changeRecordField(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, wpm), &wpm, 1);
+    updateSnapshot(beacon_nr);
+  }
+  else
+  {
+    assert(0);
+  }
+}
+
+/*!
+ * Get the text of a message, its first line. Served from memory, unless the text did not fit.
+ *
+ * \return false if the text can not be read
+ */
 bool getBeaconMessage(int beacon_nr, int msg_index, char *dest, int bufsz)
 {
-  char filename[20];
-  File f;
   if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT) && (msg_index>=0) && (msg_index <= BEACON_DEFMSG) && (bufsz>0))
   {
+    MessageConfig &entry = messageConfig[beacon_nr][msg_index];
     dest[0]=0;
-    sprintf(filename, "%d/%s.TXT", beacon_nr, msg_filenames[msg_index]);
-    f = SD.open(filename, FILE_READ);
-    if(f)
+    // The first line of a long message may go on after the part that is kept
+    if((entry.flags & CONFIG_LONG) && (bufsz > BEACON_MESSAGE_LENGTH))
+    {
+      unsigned long size;
+      return readMessageFile(beacon_nr, msg_index, dest, bufsz, &size);
+    }
+    if(!(entry.flags & CONFIG_IN_RAM))
     {
-      char c = f.read();
-      while((c != -1) && (c != '\r') && (c != '\n') && (bufsz > 1))
+      int size = (bufsz < BEACON_MESSAGE_LENGTH) ? bufsz : BEACON_MESSAGE_LENGTH;
+      size_t offset = offsetof(SettingsRecord, texts) + msg_index * BEACON_MESSAGE_LENGTH;
+      if(!readRecordField(beacon_nr, RECORD_SETTINGS, offset, dest, size))
       {
-        *dest++=c;
-        bufsz--;
-        c=f.read();
+        dest[0] = 0;
+        return false;
       }
-      *dest = 0;
-      f.close();
+      dest[size - 1] = 0;
       return true;
     }
+    int length = (entry.length < bufsz) ? entry.length : bufsz - 1;
+    memcpy(dest, &configTexts[entry.offset], length);
+    dest[length] = 0;
+    return true;
   }
   else
   {
@@ -116,19 +1130,68 @@ bool getBeaconMessage(int beacon_nr, int msg_index, char *dest, int bufsz)
   return false;
 }
 
+/*!
+ * Change the text of a message. A default message longer than BEACON_MESSAGE_LENGTH-1 characters is written
+ * to N/DEF.TXT, to be sent in parts, other messages are cut off at that length.
+ */
 void setBeaconMessage(int beacon_nr, int msg_index, char *text)
 {
   char filename[20];
   File f;
+  byte flags;
+  char kept[BEACON_MESSAGE_LENGTH];
   if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT) && (msg_index>=0) && (msg_index <= BEACON_DEFMSG))
   {
-    sprintf(filename, "%d/%s.TXT", beacon_nr, msg_filenames[msg_index]);
-    SD.remove(filename);
-    f = SD.open(filename, FILE_WRITE);
-    if(f)
+    if(!readRecordField(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, flags), &flags, 1))
+    {
+      return;
+    }
+    MessageConfig &entry = messageConfig[beacon_nr][msg_index];
+    int length = strcspn(text, "\r\n");
+    if((msg_index == BEACON_DEFMSG) && (strlen(text) >= BEACON_MESSAGE_LENGTH))
     {
+      sprintf(filename, "%d", beacon_nr);
+      SD.mkdir(filename);
+      sprintf(filename, "%d/%s.TXT", beacon_nr, msg_filenames[msg_index]);
+      SD.remove(filename);
+      f = SD.open(filename, FILE_WRITE);
+      if(!f)
+      {
+        Serial.print(F("Can not write "));
+        Serial.println(filename);
+        return;
+      }
       f.println(text);
       f.close();
+      flags |= RECORD_DEF_LONG;
+    }
+    else if(msg_index == BEACON_DEFMSG)
+    {
+      flags &= ~RECORD_DEF_LONG;
+    }
+    // The record keeps the first line, as far as it fits
+    if(length >= BEACON_MESSAGE_LENGTH)
+    {
+      length = BEACON_MESSAGE_LENGTH - 1;
+    }
+    memset(kept, 0, sizeof(kept));
+    memcpy(kept, text, length);
+    RecordChange changes[] =
+    {
+      {offsetof(SettingsRecord, flags), &flags, 1},
+      {offsetof(SettingsRecord, texts) + msg_index * BEACON_MESSAGE_LENGTH, kept, sizeof(kept)}
+    };
+    changeRecord(beacon_nr, RECORD_SETTINGS, changes, 2);
+    entry.flags &= ~CONFIG_LONG;
+    if((msg_index == BEACON_DEFMSG) && (flags & RECORD_DEF_LONG))
+    {
+      entry.flags |= CONFIG_LONG;
+    }
+    storeConfigText(entry, kept);
+    dropCachedMessage(beacon_nr, msg_index);
+    if(msg_index == BEACON_DEFMSG)
+    {
+      updateSnapshot(beacon_nr);
     }
   }
   else
@@ -139,12 +1202,9 @@ void setBeaconMessage(int beacon_nr, int msg_index, char *text)
 
 bool isBeaconMessageEnabled(int beacon_nr, int msg_index)
 {
-  char filename[20];
-  File f;
   if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT) && (msg_index>=0) && (msg_index <= BEACON_DEFMSG))
   {
-    sprintf(filename, "%d/%s.ON", beacon_nr, msg_filenames[msg_index]);
-    return SD.exists(filename);
+    return (messageConfig[beacon_nr][msg_index].flags & CONFIG_ENABLED) != 0;
   }
   else
   {
@@ -155,19 +1215,24 @@ bool isBeaconMessageEnabled(int beacon_nr, int msg_index)
 
 void setBeaconMessageEnabled(int beacon_nr, int msg_index, bool enabled)
 {
-  char filename[20];
-  File f;
+  byte bits;
   if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT) && (msg_index>=0) && (msg_index <= BEACON_DEFMSG))
   {
-    sprintf(filename, "%d/%s.ON", beacon_nr, msg_filenames[msg_index]);
-    if(enabled)
+    MessageConfig &entry = messageConfig[beacon_nr][msg_index];
+    if(((entry.flags & CONFIG_ENABLED) != 0) == enabled)
     {
-      f = SD.open(filename, FILE_WRITE);
-      f.close();
+      return; // Nothing changes
     }
-    else
+    if(readRecordField(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, enabled), &bits, 1))
     {
-      SD.remove(filename);
+      bits = enabled ? (bits | (1 << msg_index)) : (bits & ~(1 << msg_index));
+      changeRecordField(beacon_nr, RECORD_SETTINGS, offsetof(SettingsRecord, enabled), &bits, 1);
+    }
+    entry.flags = enabled ? (entry.flags | CONFIG_ENABLED) : (entry.flags & ~CONFIG_ENABLED);
+    dropCachedMessage(beacon_nr, msg_index);
+    if(msg_index == BEACON_DEFMSG)
+    {
+      updateSnapshot(beacon_nr);
     }
   }
   else
@@ -176,38 +1241,270 @@ void setBeaconMessageEnabled(int beacon_nr, int msg_index, bool enabled)
   }
 }
 
-bool getCurrentMessage(int beacon_nr, char *dest, int bufsz)
+/*!
+ * Get the schedule of the timed messages of a beacon
+ *
+ * \param dest  room for max entries, SCHEDULE_BEACON_ENTRIES at most
+ *
+ * \return the number of entries
+ */
+byte getBeaconSchedule(int beacon_nr, ScheduleEntry *dest, byte max)
 {
-  if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT) && (bufsz>0))
+  return schedulerGetEntries(beacon_nr, dest, max);
+}
+
+/*!
+ * Change the schedule of the timed messages of a beacon. The events start right away.
+ *
+ * \param entries  the new schedule, every entry checked with scheduleValid()
+ * \param count    number of entries, SCHEDULE_BEACON_ENTRIES at most
+ *
+ * \return false if the schedule is not valid or too long, nothing changes then, or if it can not be written
+ */
+bool setBeaconSchedule(int beacon_nr, const ScheduleEntry *entries, byte count)
+{
+  if((beacon_nr<0) || (beacon_nr>=BEACON_COUNT) || (count > SCHEDULE_BEACON_ENTRIES))
   {
-    dest[0]=0;
-    byte specialMessage = minute()/15;
-    if(specialMessage != lastSpecialMessage[beacon_nr])
+    return false;
+  }
+  for(byte i=0; i<count; i++)
+  {
+    if(!scheduleValid(entries[i]))
+    {
+      return false;
+    }
+  }
+  if(recordGeneration[beacon_nr] == 0)
+  {
+    Serial.print(F("Can not read the settings of beacon nr "));
+    Serial.println(beacon_nr);
+    return false;
+  }
+  if(!schedulerSetEntries(beacon_nr, entries, count))
+  {
+    Serial.print(F("No room for the schedule of beacon nr "));
+    Serial.println(beacon_nr);
+    return false;
+  }
+  RecordChange changes[] =
+  {
+    {offsetof(ScheduleRecord, scheduleCount), &count, 1},
+    {offsetof(ScheduleRecord, schedule), entries, count * sizeof(ScheduleEntry)}
+  };
+  return changeRecord(beacon_nr, RECORD_SCHEDULE, changes, 2);
+}
+
+// Read and encode a message into uncachedMessage. Halts if the text can not be encoded.
+// Returns false if the message is empty.
+static bool encodeBeaconMessage(int beacon_nr, int msg_index)
+{
+  char text[BEACON_MESSAGE_LENGTH];
+  getBeaconMessage(beacon_nr, msg_index, text, BEACON_MESSAGE_LENGTH);
+  uncachedOwner = -1;
+  if(text[0] == 0)
+  {
+    return false;
+  }
+  if(morseEncodeMessage(uncachedMessage, text, BEACON_MESSAGE_LENGTH)==false)
+  {
+    Serial.print(F("Error parsing text for beacon nr "));
+    Serial.print(beacon_nr);
+    Serial.println(":");
+    Serial.println(morseGetError());
+    while(true)
+    {
+      // General strike! We demand better code!
+    }
+  }
+  uncachedOwner = beacon_nr * (BEACON_DEFMSG+1) + msg_index;
+  return true;
+}
+
+// Find out if the message is sent, and put it in the pool if there is room. Only this reads the SD card.
+// A message that does not fit in the pool keeps valid flags, it is read again when it is needed.
+static CachedMessage &cachedMessage(int beacon_nr, int msg_index)
+{
+  CachedMessage &entry = messageCache[beacon_nr][msg_index];
+  if(!(entry.flags & CACHE_VALID))
+  {
+    entry.flags = CACHE_VALID;
+    if(isBeaconMessageEnabled(beacon_nr, msg_index))
     {
-      lastSpecialMessage[beacon_nr] = specialMessage;
-      if(isBeaconMessageEnabled(beacon_nr, specialMessage))
+      // A default message longer than a line of BEACON_MESSAGE_LENGTH is sent in parts, straight from the file
+      if((msg_index == BEACON_DEFMSG) && (messageConfig[beacon_nr][msg_index].flags & CONFIG_LONG))
+      {
+        entry.flags |= CACHE_STREAMED;
+        return entry;
+      }
+      if(encodeBeaconMessage(beacon_nr, msg_index))
       {
-        getBeaconMessage(beacon_nr, specialMessage, dest, bufsz);
+        entry.flags |= CACHE_SENDING;
+        entry.message = messagePoolAdd(uncachedMessage);
       }
     }
-    if(dest[0]==0)
+  }
+  return entry;
+}
+
+/*!
+ * Get a message of a beacon, encoded by morseEncodeMessage(). Only the first request after a change
+ * reads the SD card, later ones are served from memory, unless the message pool is full.
+ * Halts if the text can not be encoded.
+ * The message may move in memory at the next call, so use it right away.
+ *
+ * \param beacon_nr  Number of the beacon
+ * \param msg_index  BEACON_H00MSG ... BEACON_DEFMSG
+ *
+ * \return the encoded message, or 0 if the message is disabled, empty or streamed
+ *
+ * \sa isBeaconMessageStreamed()
+ */
+const byte *getEncodedBeaconMessage(int beacon_nr, int msg_index)
+{
+  if((beacon_nr<0) || (beacon_nr>=BEACON_COUNT) || (msg_index<0) || (msg_index > BEACON_DEFMSG))
+  {
+    assert(0);
+    return 0;
+  }
+  CachedMessage &entry = cachedMessage(beacon_nr, msg_index);
+  if(!(entry.flags & CACHE_SENDING))
+  {
+    return 0;
+  }
+  if(entry.message != MESSAGE_POOL_NONE)
+  {
+    return messagePoolGet(entry.message);
+  }
+  // There was no room in the pool: read it again into uncachedMessage, unless it is still there, and try the pool once more
+  if(uncachedOwner != beacon_nr * (BEACON_DEFMSG+1) + msg_index)
+  {
+    encodeBeaconMessage(beacon_nr, msg_index);
+    entry.message = messagePoolAdd(uncachedMessage);
+    if(entry.message != MESSAGE_POOL_NONE)
     {
-      if(isBeaconMessageEnabled(beacon_nr, BEACON_DEFMSG))
+      return messagePoolGet(entry.message);
+    }
+  }
+  return uncachedMessage;
+}
+
+/*!
+ * Check if a message is enabled and not empty. Only the first call after a change reads the SD card.
+ * Also true for a streamed message.
+ */
+bool isBeaconMessageSending(int beacon_nr, int msg_index)
+{
+  if((beacon_nr<0) || (beacon_nr>=BEACON_COUNT) || (msg_index<0) || (msg_index > BEACON_DEFMSG))
+  {
+    assert(0);
+    return false;
+  }
+  return (cachedMessage(beacon_nr, msg_index).flags & (CACHE_SENDING | CACHE_STREAMED)) != 0;
+}
+
+/*!
+ * Read and encode a message ahead of time, so getEncodedBeaconMessage() does not have to go to the SD card
+ * when the message is needed. Does nothing for a message that is ready, and does not read a message again
+ * when it did not fit in memory before.
+ *
+ * \return true if the message is ready in memory, or there is nothing to send
+ */
+bool prepareBeaconMessage(int beacon_nr, int msg_index)
+{
+  if((beacon_nr<0) || (beacon_nr>=BEACON_COUNT) || (msg_index<0) || (msg_index > BEACON_DEFMSG))
+  {
+    assert(0);
+    return false;
+  }
+  CachedMessage &entry = cachedMessage(beacon_nr, msg_index);
+  return !(entry.flags & CACHE_SENDING) || (entry.message != MESSAGE_POOL_NONE);
+}
+
+/*!
+ * Check if a message is longer than BEACON_MESSAGE_LENGTH. Only its first part is in the record,
+ * the whole message is kept in a file.
+ */
+bool isBeaconMessageLong(int beacon_nr, int msg_index)
+{
+  if((beacon_nr<0) || (beacon_nr>=BEACON_COUNT) || (msg_index<0) || (msg_index > BEACON_DEFMSG))
+  {
+    assert(0);
+    return false;
+  }
+  return (messageConfig[beacon_nr][msg_index].flags & CONFIG_LONG) != 0;
+}
+
+/*!
+ * Check if an enabled message is too long to be encoded at once. Such a message has to be read
+ * in parts with readBeaconMessage().
+ */
+bool isBeaconMessageStreamed(int beacon_nr, int msg_index)
+{
+  if((beacon_nr<0) || (beacon_nr>=BEACON_COUNT) || (msg_index<0) || (msg_index > BEACON_DEFMSG))
+  {
+    assert(0);
+    return false;
+  }
+  return (cachedMessage(beacon_nr, msg_index).flags & CACHE_STREAMED) != 0;
+}
+
+/*!
+ * Read a part of a message, for messages that are too long to be read at once. Line breaks are read as spaces.
+ * A $-code is never split over two parts.
+ *
+ * \param beacon_nr  Number of the beacon
+ * \param msg_index  BEACON_H00MSG ... BEACON_DEFMSG
+ * \param pos        position in the file to start reading, updated to where the next part starts
+ * \param dest       receives the text, null-terminated
+ * \param bufsz      size of dest, at least 5
+ *
+ * \return true if there is more to read
+ */
+bool readBeaconMessage(int beacon_nr, int msg_index, unsigned long *pos, char *dest, int bufsz)
+{
+  char filename[20];
+  File f;
+  int len = 0;
+  bool more = false;
+  if((beacon_nr>=0) && (beacon_nr<BEACON_COUNT) && (msg_index>=0) && (msg_index <= BEACON_DEFMSG) && (bufsz>4))
+  {
+    sprintf(filename, "%d/%s.TXT", beacon_nr, msg_filenames[msg_index]);
+    f = SD.open(filename, FILE_READ);
+    if(f && f.seek(*pos))
+    {
+      while(len < bufsz - 1)
       {
-        getBeaconMessage(beacon_nr, BEACON_DEFMSG, dest, bufsz);
+        int c = f.peek();
+        if((c == -1) || ((c == '$') && (len > bufsz - 5)))
+        {
+          // Leave room for the longest code, $Axx
+          break;
+        }
+        f.read();
+        (*pos)++;
+        if(c == '\r')
+        {
+          continue;
+        }
+        dest[len++] = (c == '\n') ? ' ' : c;
       }
+      more = (f.available() > 0);
+    }
+    if(f)
+    {
+      f.close();
     }
   }
   else
   {
     assert(0);
   }
-  return dest[0]!=0;
+  dest[len] = 0;
+  return more;
 }
 
-static void logToFile(File &f, time_t timestamp)
+static void formatLogLine(char *logline, time_t timestamp)
 {
-  char logline[LOGLINE_SIZE];
   char *ptr = logline;
   int i;
   
@@ -229,7 +1526,6 @@ static void logToFile(File &f, time_t timestamp)
   }
   *ptr++='\n';
   *ptr=0;
-  f.print(logline);
 }
 
 void writeLog(time_t timestamp)
@@ -239,33 +1535,7 @@ void writeLog(time_t timestamp)
     // Do not log if the time is unknown
     return;
   }
-  // eg: /log/2016/12/31.log
-  char filename[21];
-  File f;
-  int log_year = year(timestamp);
-  int log_month = month(timestamp);
-  int log_day = day(timestamp);
-  int log_hour = hour(timestamp);
-  int log_minute = minute(timestamp);
-  sprintf(filename, "/log/%04d/%02d/%02d.csv", log_year, log_month, log_day);
-  if(!SD.exists(filename))
-  {
-    sprintf(filename, "/log/%04d", log_year);
-    if(!SD.exists(filename))
-    {
-      SD.mkdir(filename);
-    }
-    sprintf(filename, "/log/%04d/%02d", log_year, log_month);
-    if(!SD.exists(filename))
-    {
-      SD.mkdir(filename);
-    }
-    sprintf(filename, "/log/%04d/%02d/%02d.csv", log_year, log_month, log_day);
-  }
-  f = SD.open(filename, FILE_WRITE);
-  if(f)
-  {
-    logToFile(f, timestamp);
-    f.close();
-  }
+  char logline[LOGLINE_SIZE];
+  formatLogLine(logline, timestamp);
+  dataLogAppend(timestamp, logline);
 }
@@ -1,7 +1,9 @@
 #ifndef CONTROLPANEL_H_
 #define CONTROLPANEL_H_
 
+#include <Arduino.h>
 #include <TimeLib.h>
+#include "Scheduler.h"
 
 #define BEACON_H00MSG 0
 #define BEACON_H15MSG 1
@@ -9,18 +11,40 @@
 #define BEACON_H45MSG 3
 #define BEACON_DEFMSG 4
 
+int controlPanelRestore();
 void controlPanelInit();
 
 bool isBeaconRunning(int beacon_nr);
 void setBeaconRunning(int beacon_nr, bool state);
 
+byte getBeaconSpeed(int beacon_nr);
+void setBeaconSpeed(int beacon_nr, byte wpm);
+
 bool getBeaconMessage(int beacon_nr, int msg_index, char *dest, int bufsz);
 void setBeaconMessage(int beacon_nr, int msg_index, char *text);
 
 bool isBeaconMessageEnabled(int beacon_nr, int msg_index);
 void setBeaconMessageEnabled(int beacon_nr, int msg_index, bool enabled);
 
-bool getCurrentMessage(int index, char *dest, int bufsz);
+byte getBeaconSchedule(int beacon_nr, ScheduleEntry *dest, byte max);
+bool setBeaconSchedule(int beacon_nr, const ScheduleEntry *entries, byte count);
+
+bool configBatchBegin();
+bool configBatchRunning(int beacon_nr, bool running);
+bool configBatchSpeed(int beacon_nr, byte wpm);
+bool configBatchMessage(int beacon_nr, int msg_index, const char *text);
+bool configBatchEnabled(int beacon_nr, int msg_index, bool enabled);
+bool configBatchScheduleEntry(int beacon_nr, byte index, const ScheduleEntry &entry);
+bool configBatchScheduleLength(int beacon_nr, byte count);
+bool configBatchCommit();
+void configBatchAbort();
+
+const byte *getEncodedBeaconMessage(int beacon_nr, int msg_index);
+bool isBeaconMessageLong(int beacon_nr, int msg_index);
+bool isBeaconMessageStreamed(int beacon_nr, int msg_index);
+bool isBeaconMessageSending(int beacon_nr, int msg_index);
+bool prepareBeaconMessage(int beacon_nr, int msg_index);
+bool readBeaconMessage(int beacon_nr, int msg_index, unsigned long *pos, char *dest, int bufsz);
 
 void writeLog(time_t timestamp);
 
@@ -0,0 +1,143 @@
+#include "DataLog.h"
+#include <SD.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+static File logFile;                   // file of the day of the records, open once there is a record
+static time_t logDay;                  // midnight of the day of logFile
+static char buffer[LOG_BUFFER_SIZE];
+static int buffered;                   // bytes in buffer
+static int bufferLimit;                // write when buffered reaches this, the end of a sector of the file
+static time_t oldest;                  // time of the first record in buffer
+static uint16_t preparedMonth;         // year * 12 + month of the last directories made
+static time_t preparedDay;             // midnight of the day dataLogTick() made the directories for
+
+// Make the directories for the files of the month of a day, if they are not there yet
+static void makeDirectories(time_t midnight)
+{
+  char name[14];
+  uint16_t key = year(midnight) * 12 + month(midnight);
+  if(key == preparedMonth)
+  {
+    return;
+  }
+  sprintf_P(name, PSTR("/log/%04d"), year(midnight));
+  if(!SD.exists(name))
+  {
+    SD.mkdir(name);
+  }
+  sprintf_P(name, PSTR("/log/%04d/%02d"), year(midnight), month(midnight));
+  if(!SD.exists(name))
+  {
+    SD.mkdir(name);
+  }
+  // Back in time the directories are checked every time, it is only for an old day file
+  if(key > preparedMonth)
+  {
+    preparedMonth = key;
+  }
+}
+
+static bool openDay(time_t midnight)
+{
+  // eg: /log/2016/12/31.csv
+  char filename[21];
+  makeDirectories(midnight);
+  sprintf_P(filename, PSTR("/log/%04d/%02d/%02d.csv"), year(midnight), month(midnight), day(midnight));
+  logFile = SD.open(filename, FILE_WRITE);
+  if(!logFile)
+  {
+    Serial.print(F("Can not write "));
+    Serial.println(filename);
+    return false;
+  }
+  logDay = midnight;
+  // A file that ends halfway a sector, after a flush before the sector was full, is filled up to the sector end first
+  bufferLimit = LOG_BUFFER_SIZE - logFile.size() % LOG_BUFFER_SIZE;
+  return true;
+}
+
+/*!
+ * Write the records collected so far to the SD card. Also makes the file size on the card up to date,
+ * so call it before the file of the day is read.
+ */
+void dataLogFlush()
+{
+  if(!buffered || !logFile)
+  {
+    return;
+  }
+  if(logFile.write((const uint8_t *)buffer, buffered) != (size_t)buffered)
+  {
+    Serial.println(F("Can not write the log"));
+  }
+  logFile.flush();
+  buffered = 0;
+  bufferLimit = LOG_BUFFER_SIZE - logFile.size() % LOG_BUFFER_SIZE;
+}
+
+/*!
+ * Add a record to the log, in the file of the day of its time
+ *
+ * \param timestamp  time of the record
+ * \param record     a line of text, with its line end
+ */
+void dataLogAppend(time_t timestamp, const char *record)
+{
+  time_t midnight = previousMidnight(timestamp);
+  if(logFile && (midnight != logDay))
+  {
+    dataLogFlush();
+    logFile.close();
+  }
+  if(!logFile && !openDay(midnight))
+  {
+    return;
+  }
+  if(!buffered)
+  {
+    oldest = timestamp;
+  }
+  // A record that does not fit is split over two sectors
+  size_t len = strlen(record);
+  while(len)
+  {
+    size_t part = bufferLimit - buffered;
+    if(part > len)
+    {
+      part = len;
+    }
+    memcpy(&buffer[buffered], record, part);
+    buffered += part;
+    record += part;
+    len -= part;
+    if(buffered == bufferLimit)
+    {
+      dataLogFlush();
+    }
+  }
+}
+
+/*!
+ * Call regularly from the main loop, once the time is known. Writes records that waited LOG_FLUSH_AGE,
+ * closes the file of a day that is over, and makes the directories for tomorrow before the first record
+ * of tomorrow needs them.
+ */
+void dataLogTick(time_t now)
+{
+  time_t midnight = previousMidnight(now);
+  if(buffered && (now - oldest >= LOG_FLUSH_AGE))
+  {
+    dataLogFlush();
+  }
+  if(logFile && (midnight != logDay))
+  {
+    dataLogFlush();
+    logFile.close();
+  }
+  if(midnight + SECS_PER_DAY != preparedDay)
+  {
+    preparedDay = midnight + SECS_PER_DAY;
+    makeDirectories(preparedDay);
+  }
+}
@@ -0,0 +1,14 @@
+#ifndef DATALOG_H_
+#define DATALOG_H_
+
+#include <Arduino.h>
+#include <TimeLib.h>
+#include "Config.h"
+
+// Appends records to the day files of the log, /log/<year>/<month>/<day>.csv. The file of the day stays open,
+// and records are collected in RAM until a whole sector can be written, the day ends or LOG_FLUSH_AGE passes.
+void dataLogAppend(time_t timestamp, const char *record);
+void dataLogTick(time_t now);
+void dataLogFlush();
+
+#endif
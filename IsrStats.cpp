@@ -0,0 +1,90 @@
+#include "IsrStats.h"
+
+#ifdef ENABLE_ISR_STATS
+
+static IsrStats stats;
+
+static void histogramAdd(IsrHistogram &h, unsigned value)
+{
+  if(value < h.min)
+  {
+    h.min = value;
+  }
+  if(value > h.max)
+  {
+    h.max = value;
+  }
+  byte bucket = 0;
+  while(value && (bucket < ISR_STATS_BUCKETS - 1))
+  {
+    value >>= 1;
+    bucket++;
+  }
+  h.buckets[bucket]++;
+}
+
+/*!
+ * Add a measurement. Only call this from the beacon interrupt.
+ *
+ * \param metric  ISR_STATS_DURATION ... ISR_STATS_MISSED
+ * \param value   Timer1 counts, or ticks for ISR_STATS_MISSED
+ */
+void isrStatsRecord(byte metric, unsigned value)
+{
+  histogramAdd(stats.histograms[metric], value);
+  if(metric == ISR_STATS_MISSED)
+  {
+    stats.missedTicks += value;
+  }
+}
+
+/*!
+ * Add the duration of one Beacon::tick() call. Only call this from the beacon interrupt.
+ */
+void isrStatsRecordTick(byte beacon_nr, unsigned value)
+{
+  histogramAdd(stats.histograms[ISR_STATS_TICK], value);
+  if(value > stats.tickMax[beacon_nr])
+  {
+    stats.tickMax[beacon_nr] = value;
+  }
+}
+
+/*!
+ * Take a copy of the measurements, for the main loop
+ */
+void isrStatsGet(IsrStats *dest)
+{
+  // Copy in parts, so the beacon interrupt is not held up for too long
+  for(byte i = 0; i < ISR_STATS_COUNT; i++)
+  {
+    cli();
+    dest->histograms[i] = stats.histograms[i];
+    sei();
+  }
+  cli();
+  for(byte i = 0; i < BEACON_COUNT; i++)
+  {
+    dest->tickMax[i] = stats.tickMax[i];
+  }
+  dest->missedTicks = stats.missedTicks;
+  sei();
+}
+
+/*!
+ * Start measuring again
+ */
+void isrStatsReset()
+{
+  IsrStats empty;
+  memset(&empty, 0, sizeof(empty));
+  for(byte i = 0; i < ISR_STATS_COUNT; i++)
+  {
+    empty.histograms[i].min = 0xFFFF;
+  }
+  cli();
+  stats = empty;
+  sei();
+}
+
+#endif
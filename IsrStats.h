@@ -0,0 +1,51 @@
+#ifndef ISRSTATS_H_
+#define ISRSTATS_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// Measurements of the beacon interrupt, in Timer1 counts (see BEACON_TIMER_PRESCALER).
+// Bucket i of a histogram counts the values of i bits: 0, 1, 2-3, 4-7, ... and the last one everything above.
+#define ISR_STATS_BUCKETS 10
+
+#define ISR_STATS_DURATION 0  // whole interrupt, from entry to exit
+#define ISR_STATS_TICK     1  // one Beacon::tick() call
+#define ISR_STATS_LATENCY  2  // from the compare match to the interrupt entry
+#define ISR_STATS_MISSED   3  // whole ticks the interrupt came late, per interrupt
+#define ISR_STATS_COUNT    4
+
+struct IsrHistogram
+{
+  unsigned min;
+  unsigned max;
+  unsigned long buckets[ISR_STATS_BUCKETS];
+};
+
+struct IsrStats
+{
+  IsrHistogram histograms[ISR_STATS_COUNT];
+  unsigned tickMax[BEACON_COUNT];  // longest Beacon::tick() of each beacon
+  unsigned long missedTicks;
+};
+
+#ifdef ENABLE_ISR_STATS
+
+void isrStatsRecord(byte metric, unsigned value);
+void isrStatsRecordTick(byte beacon_nr, unsigned value);
+void isrStatsGet(IsrStats *dest);
+void isrStatsReset();
+
+// Timer1 counts, for timing parts of the interrupt
+#define ISR_STATS_NOW()               TCNT1
+#define ISR_STATS_RECORD(metric, v)   isrStatsRecord((metric), (v))
+#define ISR_STATS_RECORD_TICK(nr, v)  isrStatsRecordTick((nr), (v))
+
+#else
+
+#define ISR_STATS_NOW()               0
+#define ISR_STATS_RECORD(metric, v)
+#define ISR_STATS_RECORD_TICK(nr, v)
+
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+#include "Json.h"
+#include <string.h>
+
+/*!
+ * Start reading a document
+ *
+ * \param in        where the document comes from
+ * \param length    bytes in the document, as in the Content-Length of a request
+ * \param text      receives the strings, null-terminated
+ * \param textSize  size of text, longer strings are an error
+ */
+void jsonBegin(JsonReader &r, Stream &in, long length, char *text, int textSize)
+{
+  r.in = &in;
+  r.left = length;
+  r.peeked = -1;
+  r.text = text;
+  r.textSize = textSize;
+  r.number = 0;
+  r.error = 0;
+}
+
+/*!
+ * Stop reading with an error. Only the first error is kept.
+ *
+ * \return false
+ */
+bool jsonFail(JsonReader &r, const __FlashStringHelper *error)
+{
+  if(!r.error)
+  {
+    r.error = error;
+  }
+  return false;
+}
+
+// Next character of the document, -1 at the end
+static int next(JsonReader &r)
+{
+  if(r.peeked >= 0)
+  {
+    int c = r.peeked;
+    r.peeked = -1;
+    return c;
+  }
+  if(r.left <= 0)
+  {
+    return -1;
+  }
+  unsigned long start = millis();
+  while(!r.in->available())
+  {
+    if(millis() - start > JSON_TIMEOUT_MS)
+    {
+      jsonFail(r, F("the document stops"));
+      r.left = 0;
+      return -1;
+    }
+  }
+  r.left--;
+  return r.in->read();
+}
+
+static int nextNonSpace(JsonReader &r)
+{
+  int c;
+  do
+  {
+    c = next(r);
+  } while((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'));
+  return c;
+}
+
+static char readWord(JsonReader &r, const char *rest, char token)
+{
+  while(*rest)
+  {
+    if(next(r) != *rest++)
+    {
+      jsonFail(r, F("not valid JSON"));
+      return JSON_ERROR;
+    }
+  }
+  return token;
+}
+
+static char readString(JsonReader &r)
+{
+  int len = 0;
+  while(true)
+  {
+    int c = next(r);
+    if(c < 0x20)
+    {
+      jsonFail(r, F("string not ended"));
+      return JSON_ERROR;
+    }
+    if(c == '"')
+    {
+      break;
+    }
+    if(c == '\\')
+    {
+      c = next(r);
+      switch(c)
+      {
+        case '"':
+        case '\\':
+        case '/':
+          break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u':
+        {
+          c = 0;
+          for(byte i = 0; i < 4; i++)
+          {
+            int h = next(r);
+            c = c * 16 + (isdigit(h) ? h - '0' : (isxdigit(h) ? (h | 0x20) - 'a' + 10 : 0x100));
+          }
+          if((c == 0) || (c > 0x7F))
+          {
+            jsonFail(r, F("only ASCII characters"));
+            return JSON_ERROR;
+          }
+          break;
+        }
+        default:
+          jsonFail(r, F("not valid JSON"));
+          return JSON_ERROR;
+      }
+    }
+    else if(c > 0x7F)
+    {
+      jsonFail(r, F("only ASCII characters"));
+      return JSON_ERROR;
+    }
+    if(len == r.textSize - 1)
+    {
+      jsonFail(r, F("string too long"));
+      return JSON_ERROR;
+    }
+    r.text[len++] = c;
+  }
+  r.text[len] = 0;
+  return JSON_STRING;
+}
+
+static char readNumber(JsonReader &r, int c)
+{
+  bool negative = (c == '-');
+  if(negative)
+  {
+    c = next(r);
+  }
+  if(!isdigit(c))
+  {
+    jsonFail(r, F("not valid JSON"));
+    return JSON_ERROR;
+  }
+  r.number = 0;
+  while(isdigit(c))
+  {
+    if(r.number > 99999999L)
+    {
+      jsonFail(r, F("number too large"));
+      return JSON_ERROR;
+    }
+    r.number = r.number * 10 + (c - '0');
+    c = next(r);
+  }
+  if((c == '.') || (c == 'e') || (c == 'E'))
+  {
+    jsonFail(r, F("only whole numbers"));
+    return JSON_ERROR;
+  }
+  r.peeked = c;
+  if(negative)
+  {
+    r.number = -r.number;
+  }
+  return JSON_NUMBER;
+}
+
+/*!
+ * Read the next token
+ *
+ * \return one of { } [ ] : , JSON_STRING, JSON_NUMBER, JSON_TRUE, JSON_FALSE or JSON_NULL,
+ *         JSON_ERROR at the end of the document or on an error
+ */
+char jsonToken(JsonReader &r)
+{
+  if(r.error)
+  {
+    return JSON_ERROR;
+  }
+  int c = nextNonSpace(r);
+  switch(c)
+  {
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+      return c;
+    case '"':
+      return readString(r);
+    case 't':
+      return readWord(r, "rue", JSON_TRUE);
+    case 'f':
+      return readWord(r, "alse", JSON_FALSE);
+    case 'n':
+      return readWord(r, "ull", JSON_NULL);
+    case -1:
+      jsonFail(r, F("the document stops"));
+      return JSON_ERROR;
+  }
+  if((c == '-') || isdigit(c))
+  {
+    return readNumber(r, c);
+  }
+  jsonFail(r, F("not valid JSON"));
+  return JSON_ERROR;
+}
+
+/*!
+ * Go to the next member of an object, after its { is read. Start with first set to true.
+ *
+ * \return true with the name of the member in the text of the reader, and its : read,
+ *         false at the } or on an error
+ */
+bool jsonMember(JsonReader &r, bool &first)
+{
+  char token = jsonToken(r);
+  if(token == '}')
+  {
+    return false;
+  }
+  if(!first)
+  {
+    if(token != ',')
+    {
+      return jsonFail(r, F("expected , or }"));
+    }
+    token = jsonToken(r);
+  }
+  first = false;
+  if(token != JSON_STRING)
+  {
+    return jsonFail(r, F("expected a name"));
+  }
+  if(jsonToken(r) != ':')
+  {
+    return jsonFail(r, F("expected :"));
+  }
+  return true;
+}
+
+/*!
+ * Go to the next item of an array, after its [ is read. Start with first set to true.
+ *
+ * \param token  receives the first token of the item
+ *
+ * \return true if there is an item, false at the ] or on an error
+ */
+bool jsonItem(JsonReader &r, bool &first, char *token)
+{
+  *token = jsonToken(r);
+  if(*token == ']')
+  {
+    return false;
+  }
+  if(!first)
+  {
+    if(*token != ',')
+    {
+      return jsonFail(r, F("expected , or ]"));
+    }
+    *token = jsonToken(r);
+  }
+  first = false;
+  return (*token != JSON_ERROR);
+}
+
+/*!
+ * Skip a value, of which the first token is read
+ *
+ * \return false on an error
+ */
+bool jsonSkip(JsonReader &r, char token)
+{
+  bool first = true;
+  if(token == '{')
+  {
+    while(jsonMember(r, first))
+    {
+      if(!jsonSkip(r, jsonToken(r)))
+      {
+        return false;
+      }
+    }
+  }
+  else if(token == '[')
+  {
+    while(jsonItem(r, first, &token))
+    {
+      if(!jsonSkip(r, token))
+      {
+        return false;
+      }
+    }
+  }
+  else if((token == '}') || (token == ']') || (token == ':') || (token == ','))
+  {
+    jsonFail(r, F("not valid JSON"));
+  }
+  return !r.error;
+}
+
+/*!
+ * Check that nothing but white space follows the document
+ */
+bool jsonEnd(JsonReader &r)
+{
+  if(r.error)
+  {
+    return false;
+  }
+  if(nextNonSpace(r) != -1)
+  {
+    return jsonFail(r, F("more after the document"));
+  }
+  return !r.error;
+}
+
+/*!
+ * Write a string as a JSON string, with its quotes
+ */
+void jsonPrintString(Print &out, const char *text)
+{
+  out.print('"');
+  for(; *text; text++)
+  {
+    if((*text == '"') || (*text == '\\'))
+    {
+      out.print('\\');
+      out.print(*text);
+    }
+    else if((byte)*text < 0x20)
+    {
+      char code[7];
+      sprintf_P(code, PSTR("\\u%04x"), *text);
+      out.print(code);
+    }
+    else
+    {
+      out.print(*text);
+    }
+  }
+  out.print('"');
+}
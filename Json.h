@@ -0,0 +1,39 @@
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <Arduino.h>
+
+// Streaming JSON reader: the document is read a token at a time, straight from the network,
+// so it never has to fit in memory. Only whole numbers and ASCII strings are supported.
+#define JSON_ERROR  0
+#define JSON_STRING 's'  // the text is in the buffer of the reader
+#define JSON_NUMBER 'n'  // the value is in number
+#define JSON_TRUE   't'
+#define JSON_FALSE  'f'
+#define JSON_NULL   'z'
+// and the structural characters { } [ ] : ,
+
+// Time to wait for the next part of the document
+#define JSON_TIMEOUT_MS 2000
+
+struct JsonReader
+{
+  Stream *in;
+  long left;          // bytes of the document not read yet
+  int peeked;         // character read ahead, -1 if none
+  char *text;         // receives strings
+  int textSize;
+  long number;
+  const __FlashStringHelper *error;  // 0 while all is well
+};
+
+void jsonBegin(JsonReader &r, Stream &in, long length, char *text, int textSize);
+char jsonToken(JsonReader &r);
+bool jsonMember(JsonReader &r, bool &first);
+bool jsonItem(JsonReader &r, bool &first, char *token);
+bool jsonSkip(JsonReader &r, char token);
+bool jsonEnd(JsonReader &r);
+bool jsonFail(JsonReader &r, const __FlashStringHelper *error);
+void jsonPrintString(Print &out, const char *text);
+
+#endif
@@ -0,0 +1,108 @@
+#include "KeyShaping.h"
+#include <avr/pgmspace.h>
+
+// Raised cosine, 255 * (1 - cos(pi * i / SHAPING_STEPS)) / 2. Falling runs through it backwards.
+static const byte envelope[SHAPING_STEPS + 1] PROGMEM =
+{
+    0,   1,   2,   5,  10,  15,  21,  29,  37,  47,  57,  67,  79,  90, 103, 115,
+  127, 140, 152, 165, 176, 188, 198, 208, 218, 226, 234, 240, 245, 250, 253, 254,
+  255
+};
+
+struct ShapingChannel
+{
+  volatile uint16_t *ocr;  // compare register of the PWM pin
+  byte step;               // position in the envelope
+  byte target;             // step the envelope is heading for
+};
+
+// Only used by the beacon interrupt and the Timer3 interrupt, which do not interrupt each other
+static ShapingChannel channels[BEACON_COUNT];
+static byte channelCount = 0;
+static byte overflows = KEY_SHAPING_STEP_OVERFLOWS;
+
+/*!
+ * Set up a PWM pin to follow the keying of a beacon. Only the pins of Timer3, 4 and 5 can be used:
+ * 2, 3, 5, 6, 7, 8, 44, 45 and 46. Timer3 is also used to step the envelopes. Call this before the interrupts are enabled.
+ *
+ * \param pin  Arduino pin number
+ *
+ * \return the channel to pass to shapingKey(), SHAPING_NONE if the pin has no suitable PWM output
+ */
+byte shapingAttachPin(int pin)
+{
+  volatile uint8_t *tccra;
+  volatile uint8_t *tccrb;
+  volatile uint16_t *ocr;
+  byte com;
+  if((pin < 0) || (channelCount == BEACON_COUNT))
+  {
+    return SHAPING_NONE;
+  }
+  switch(digitalPinToTimer(pin))
+  {
+    case TIMER3A: tccra = &TCCR3A; tccrb = &TCCR3B; ocr = &OCR3A; com = _BV(COM3A1); break;
+    case TIMER3B: tccra = &TCCR3A; tccrb = &TCCR3B; ocr = &OCR3B; com = _BV(COM3B1); break;
+    case TIMER3C: tccra = &TCCR3A; tccrb = &TCCR3B; ocr = &OCR3C; com = _BV(COM3C1); break;
+    case TIMER4A: tccra = &TCCR4A; tccrb = &TCCR4B; ocr = &OCR4A; com = _BV(COM4A1); break;
+    case TIMER4B: tccra = &TCCR4A; tccrb = &TCCR4B; ocr = &OCR4B; com = _BV(COM4B1); break;
+    case TIMER4C: tccra = &TCCR4A; tccrb = &TCCR4B; ocr = &OCR4C; com = _BV(COM4C1); break;
+    case TIMER5A: tccra = &TCCR5A; tccrb = &TCCR5B; ocr = &OCR5A; com = _BV(COM5A1); break;
+    case TIMER5B: tccra = &TCCR5A; tccrb = &TCCR5B; ocr = &OCR5B; com = _BV(COM5B1); break;
+    case TIMER5C: tccra = &TCCR5A; tccrb = &TCCR5B; ocr = &OCR5C; com = _BV(COM5C1); break;
+    default:
+      return SHAPING_NONE;
+  }
+  // Fast PWM, 8 bit (WGM 5), prescaler 8. Timer3 also runs without a pin, it steps the envelopes.
+  TCCR3A = (TCCR3A & (_BV(COM3A1) | _BV(COM3B1) | _BV(COM3C1))) | _BV(WGM30);
+  TCCR3B = _BV(WGM32) | _BV(CS31);
+  *tccra = (*tccra & (_BV(COM3A1) | _BV(COM3B1) | _BV(COM3C1))) | _BV(WGM30) | com;  // same bits for all 3 timers
+  *tccrb = _BV(WGM32) | _BV(CS31);
+  *ocr = 0;
+  pinMode(pin, OUTPUT);
+
+  channels[channelCount].ocr = ocr;
+  channels[channelCount].step = 0;
+  channels[channelCount].target = 0;
+  return channelCount++;
+}
+
+/*!
+ * Start the rise or fall of an envelope. Called by the beacon interrupt when the keying changes.
+ *
+ * \param channel  as returned by shapingAttachPin()
+ * \param on       true to rise to full output, false to fall to 0
+ */
+void shapingKey(byte channel, boolean on)
+{
+  channels[channel].target = on ? SHAPING_STEPS : 0;
+  TIMSK3 |= _BV(TOIE3);
+}
+
+/*!
+ * Body of the Timer3 overflow interrupt: move every envelope one step towards its target.
+ * Turns itself off when all envelopes are steady.
+ */
+void shapingInterrupt()
+{
+  if(--overflows)
+  {
+    return;
+  }
+  overflows = KEY_SHAPING_STEP_OVERFLOWS;
+  boolean moving = false;
+  for(byte i = 0; i < channelCount; i++)
+  {
+    ShapingChannel &c = channels[i];
+    if(c.step != c.target)
+    {
+      c.step += (c.step < c.target) ? 1 : -1;
+      *c.ocr = pgm_read_byte(&envelope[c.step]);
+      moving = true;
+    }
+  }
+  if(!moving)
+  {
+    TIMSK3 &= ~_BV(TOIE3);
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef KEYSHAPING_H_
+#define KEYSHAPING_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// Shaped keying: a PWM pin follows the keying of a beacon with a raised cosine envelope, to avoid key clicks.
+// The PWM runs on Timer3, 4 or 5 at F_CPU / 8 / 256 (7.8 kHz with a 16 MHz clock), to be filtered by an RC network.
+// The envelope is stepped from the Timer3 overflow interrupt, which only runs while an envelope is rising or falling.
+// Rise and fall take SHAPING_STEPS steps of KEY_SHAPING_STEP_OVERFLOWS Timer3 overflows.
+#define SHAPING_STEPS 32
+#define SHAPING_NONE  0xFF
+
+byte shapingAttachPin(int pin);
+void shapingKey(byte channel, boolean on);
+void shapingInterrupt();
+
+#endif
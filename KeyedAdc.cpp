@@ -0,0 +1,167 @@
+#include "KeyedAdc.h"
+
+// Timer1 counts from a key change to the start of the first conversion
+#define DELAY_COUNTS ((unsigned long)KEYED_ADC_DELAY_US * (F_CPU / BEACON_TIMER_PRESCALER) / 1000000UL)
+
+#define STATE_IDLE      0
+#define STATE_FORWARD   1  // waiting for the compare match, or converting the forward channel
+#define STATE_REFLECTED 2  // converting the reflected channel
+
+struct KeyedAdcChannel
+{
+  int beacon_nr;
+  byte input[2];            // forward and reflected analog channel, KEYED_ADC_NONE for no reflected channel
+  unsigned average[2][2];   // [forward/reflected][key up/down], 16 times the ADC value
+  unsigned long samples[2]; // [key up/down]
+};
+
+// Only changed by the beacon interrupt and the ADC interrupt, which do not interrupt each other
+static KeyedAdcChannel channels[BEACON_COUNT];
+static byte channelCount = 0;
+static volatile byte state = STATE_IDLE;
+static byte active;       // channel being measured
+static byte activeKey;    // 1 for key down, 0 for key up
+static volatile boolean mainWaiting = false;  // keyedAdcAnalogRead() wants the ADC
+
+static void selectInput(byte input)
+{
+  ADMUX = _BV(REFS0) | (input & 7);  // AVcc reference, as analogRead()
+  ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((input & 8) ? _BV(MUX5) : 0);
+}
+
+// Moving average over about 16 samples, in 16 times the ADC value. The first sample sets it.
+static void addSample(unsigned &average, int value, boolean first)
+{
+  average = first ? (value << 4) : (average - (average >> 4) + value);
+}
+
+/*!
+ * Sample the power detectors of a beacon at its key changes. Call before the interrupts are enabled,
+ * and pass the channel to Beacon::samplePower().
+ *
+ * \param beacon_nr  Number of the beacon
+ * \param forward    analog channel of the forward power detector
+ * \param reflected  analog channel of the reflected power detector, KEYED_ADC_NONE if there is none
+ *
+ * \return the channel to pass to keyedAdcKey(), KEYED_ADC_NONE if the inputs can not be used
+ */
+byte keyedAdcAttach(int beacon_nr, byte forward, byte reflected)
+{
+  if((forward >= NUM_ANALOG_CHANNELS) || ((reflected != KEYED_ADC_NONE) && (reflected >= NUM_ANALOG_CHANNELS)) ||
+     (channelCount == BEACON_COUNT))
+  {
+    return KEYED_ADC_NONE;
+  }
+  KeyedAdcChannel &c = channels[channelCount];
+  c.beacon_nr = beacon_nr;
+  c.input[0] = forward;
+  c.input[1] = reflected;
+  c.samples[0] = c.samples[1] = 0;
+  return channelCount++;
+}
+
+/*!
+ * Start a measurement after a key change. Called by the beacon interrupt: it only arms the compare match.
+ *
+ * \param channel  as returned by keyedAdcAttach()
+ * \param on       true at key down, false at key up
+ */
+void keyedAdcKey(byte channel, boolean on)
+{
+  if((state == STATE_FORWARD) && (active == channel) && (ADCSRA & _BV(ADATE)))
+  {
+    // The key changed again before the sample was taken, it would be in the wrong average
+    ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+    state = STATE_IDLE;
+  }
+  if((state != STATE_IDLE) || mainWaiting)
+  {
+    return;
+  }
+  active = channel;
+  activeKey = on ? 1 : 0;
+  selectInput(channels[channel].input[0]);
+  // Start the conversion at the compare match B of the free running Timer1, at the rising edge of its flag
+  OCR1B = TCNT1 + DELAY_COUNTS;
+  TIFR1 = _BV(OCF1B);
+  ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) | _BV(ADTS2) | _BV(ADTS0);
+  ADCSRA |= _BV(ADATE) | _BV(ADIE);
+  state = STATE_FORWARD;
+}
+
+/*!
+ * Body of the ADC interrupt: store a result, and convert the reflected channel after the forward one
+ */
+void keyedAdcInterrupt()
+{
+  int value = ADC;
+  KeyedAdcChannel &c = channels[active];
+  boolean first = (c.samples[activeKey] == 0);
+  if(state == STATE_FORWARD)
+  {
+    ADCSRA &= ~_BV(ADATE);
+    TIFR1 = _BV(OCF1B);
+    addSample(c.average[0][activeKey], value, first);
+    if(c.input[1] != KEYED_ADC_NONE)
+    {
+      selectInput(c.input[1]);
+      ADCSRA |= _BV(ADSC);
+      state = STATE_REFLECTED;
+      return;
+    }
+  }
+  else
+  {
+    addSample(c.average[1][activeKey], value, first);
+  }
+  c.samples[activeKey]++;
+  ADCSRA &= ~_BV(ADIE);
+  state = STATE_IDLE;
+}
+
+/*!
+ * analogRead() for the main loop, that waits for a running measurement and holds off new ones.
+ * All other analog reads must go through this while beacons are sampled.
+ */
+int keyedAdcAnalogRead(byte input)
+{
+  if(channelCount == 0)
+  {
+    return analogRead(input);
+  }
+  mainWaiting = true;
+  while(state != STATE_IDLE)
+  {
+    // At most KEYED_ADC_DELAY_US and 2 conversions
+  }
+  int value = analogRead(input);
+  mainWaiting = false;
+  return value;
+}
+
+/*!
+ * Get the averaged measurements of a beacon
+ *
+ * \return false if the beacon has no power detectors
+ */
+bool keyedAdcGet(int beacon_nr, KeyedAdcReading *dest)
+{
+  for(byte i = 0; i < channelCount; i++)
+  {
+    KeyedAdcChannel &c = channels[i];
+    if(c.beacon_nr == beacon_nr)
+    {
+      cli();
+      dest->forwardOn = c.average[0][1] >> 4;
+      dest->reflectedOn = c.average[1][1] >> 4;
+      dest->forwardOff = c.average[0][0] >> 4;
+      dest->reflectedOff = c.average[1][0] >> 4;
+      dest->samplesOn = c.samples[1];
+      dest->samplesOff = c.samples[0];
+      sei();
+      dest->reflected = (c.input[1] != KEYED_ADC_NONE);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,32 @@
+#ifndef KEYEDADC_H_
+#define KEYEDADC_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// Key-synchronized analog sampling, for the forward and reflected power detectors of the beacons.
+// A fixed time after every key down and key up of a beacon, KEYED_ADC_DELAY_US, its forward channel is sampled,
+// followed by its reflected channel. The key down and key up readings are averaged apart.
+// The first conversion is started by the ADC hardware at a Timer1 compare match B, so the beacon interrupt only
+// sets the compare register, and the results are read in the ADC interrupt.
+// One measurement runs at a time: key changes that come in the mean time are not sampled.
+#define KEYED_ADC_NONE 0xFF
+
+struct KeyedAdcReading
+{
+  unsigned forwardOn;     // ADC values (0-1023) with the key down, averaged over the last 16 or so samples
+  unsigned reflectedOn;
+  unsigned forwardOff;    // the same with the key up
+  unsigned reflectedOff;
+  unsigned long samplesOn;
+  unsigned long samplesOff;
+  boolean reflected;      // false if there is no reflected power detector
+};
+
+byte keyedAdcAttach(int beacon_nr, byte forward, byte reflected);
+void keyedAdcKey(byte channel, boolean on);
+void keyedAdcInterrupt();
+int keyedAdcAnalogRead(byte input);
+bool keyedAdcGet(int beacon_nr, KeyedAdcReading *dest);
+
+#endif
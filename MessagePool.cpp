@@ -0,0 +1,145 @@
+#include "MessagePool.h"
+#include "BeaconController.h"
+#include <string.h>
+#include <assert.h>
+
+// Every block in the arena starts with its length and the id of its message, MESSAGE_POOL_NONE once it is released.
+// Released blocks stay where they are until the arena is compacted.
+#define BLOCK_HEADER 2
+
+struct PoolEntry
+{
+  unsigned offset;  // of the message in the arena, after the block header
+  byte refs;        // 0 when the entry is free
+};
+
+static byte arena[MESSAGE_POOL_SIZE];
+static unsigned arenaEnd;   // blocks end here, the rest of the arena is unused
+static unsigned liveBytes;  // bytes in blocks that are not released
+static PoolEntry entries[MESSAGE_POOL_ENTRIES];
+
+void messagePoolInit()
+{
+  arenaEnd = 0;
+  liveBytes = 0;
+  for(byte i = 0; i < MESSAGE_POOL_ENTRIES; i++)
+  {
+    entries[i].refs = 0;
+  }
+}
+
+// Move the blocks in use to the start of the arena, so all room left is in one piece at the end
+static void compact()
+{
+  unsigned from = 0;
+  unsigned to = 0;
+  while(from < arenaEnd)
+  {
+    unsigned size = BLOCK_HEADER + arena[from];
+    byte id = arena[from + 1];
+    if(id != MESSAGE_POOL_NONE)
+    {
+      if(from != to)
+      {
+        memmove(&arena[to], &arena[from], size);
+        entries[id].offset = to + BLOCK_HEADER;
+      }
+      to += size;
+    }
+    from += size;
+  }
+  arenaEnd = to;
+}
+
+/*!
+ * Store an encoded message, or take one more reference to an identical message that is already stored.
+ * Every successful call must be paired with messagePoolRelease().
+ *
+ * \param encoded  the message, as encoded by morseEncodeMessage()
+ *
+ * \return the id of the message, MESSAGE_POOL_NONE if the pool is full
+ */
+byte messagePoolAdd(const byte *encoded)
+{
+  int length = morseEncodedLength(encoded);
+  byte id = MESSAGE_POOL_NONE;
+  for(byte i = 0; i < MESSAGE_POOL_ENTRIES; i++)
+  {
+    if(entries[i].refs == 0)
+    {
+      if(id == MESSAGE_POOL_NONE)
+      {
+        id = i;
+      }
+    }
+    else if((arena[entries[i].offset - BLOCK_HEADER] == length) && (memcmp(&arena[entries[i].offset], encoded, length) == 0))
+    {
+      entries[i].refs++;
+      return i;
+    }
+  }
+  if((id == MESSAGE_POOL_NONE) || (length > 255))
+  {
+    return MESSAGE_POOL_NONE;
+  }
+  unsigned size = BLOCK_HEADER + length;
+  if(arenaEnd + size > MESSAGE_POOL_SIZE)
+  {
+    if(liveBytes + size > MESSAGE_POOL_SIZE)
+    {
+      return MESSAGE_POOL_NONE;
+    }
+    compact();
+  }
+  arena[arenaEnd] = length;
+  arena[arenaEnd + 1] = id;
+  memcpy(&arena[arenaEnd + BLOCK_HEADER], encoded, length);
+  entries[id].offset = arenaEnd + BLOCK_HEADER;
+  entries[id].refs = 1;
+  arenaEnd += size;
+  liveBytes += size;
+  return id;
+}
+
+/*!
+ * Drop a reference to a message. The message is released with its last reference.
+ */
+void messagePoolRelease(byte id)
+{
+  if((id >= MESSAGE_POOL_ENTRIES) || (entries[id].refs == 0))
+  {
+    assert(0);
+    return;
+  }
+  if(--entries[id].refs == 0)
+  {
+    unsigned block = entries[id].offset - BLOCK_HEADER;
+    arena[block + 1] = MESSAGE_POOL_NONE;
+    liveBytes -= BLOCK_HEADER + arena[block];
+    if(block + BLOCK_HEADER + arena[block] == arenaEnd)
+    {
+      arenaEnd = block;  // The last block can be given back right away
+    }
+  }
+}
+
+/*!
+ * Get a stored message. The pointer is only valid until the next messagePoolAdd(), which may move the message.
+ */
+const byte *messagePoolGet(byte id)
+{
+  if((id >= MESSAGE_POOL_ENTRIES) || (entries[id].refs == 0))
+  {
+    assert(0);
+    return 0;
+  }
+  return &arena[entries[id].offset];
+}
+
+/*!
+ * Returns the number of bytes left in the pool, including the room that compacting would give back
+ */
+unsigned messagePoolFree()
+{
+  return MESSAGE_POOL_SIZE - liveBytes;
+}
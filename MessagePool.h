@@ -0,0 +1,20 @@
+#ifndef MESSAGEPOOL_H_
+#define MESSAGEPOOL_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// Encoded messages of all beacons share one arena of MESSAGE_POOL_SIZE bytes. Every message takes
+// only its own length, and beacons with the same text share one copy, counted by references.
+// Messages are known by an id, because the arena is compacted when it runs out of room.
+#define MESSAGE_POOL_NONE    0xFF
+// Every message of every beacon different, as far as the ids go. Messages that do not fit are not cached.
+#define MESSAGE_POOL_ENTRIES (BEACON_COUNT * 5 < MESSAGE_POOL_NONE ? BEACON_COUNT * 5 : MESSAGE_POOL_NONE)
+
+void messagePoolInit();
+byte messagePoolAdd(const byte *encoded);
+void messagePoolRelease(byte id);
+const byte *messagePoolGet(byte id);
+unsigned messagePoolFree();
+
+#endif
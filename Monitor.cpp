@@ -0,0 +1,323 @@
+#include "Monitor.h"
+#include "BeaconController.h"
+#include "ControlPanel.h"
+#include "KeyedAdc.h"
+#include <string.h>
+
+// Marks up to 2 dots are dots, longer ones dashes, and marks over 5 dots are carrier on delays.
+// Spaces over 2 dots end a character, over 5 dots a word.
+#define SHORT_LIMIT 2
+#define LONG_LIMIT  5
+// An analog input needs at least this difference between mark and space, otherwise it is all space
+#define MONITOR_ANALOG_MIN_SWING 20
+
+#define WORD_BAD  0x01  // an unknown character
+#define WORD_LONG 0x02  // more than MONITOR_WORD_LENGTH characters
+#define WORD_GAP  0x04  // the input was not sampled for longer than a dot, elements may be missing
+
+extern Beacon beacons[BEACON_COUNT];
+
+struct MonitorDecoder
+{
+  byte input;             // MONITOR_NONE when not in use
+  boolean mark;           // input level at the last sample
+  boolean cut;            // the element going on started before a pause in sampling, its length is not known
+  unsigned long edge;     // millis() of the last change
+  unsigned long sampled;  // millis() of the last sample
+  unsigned dot;           // estimated dot length in ms
+  byte code;              // elements of the current character so far, the last one in bit 0, 1 = dash
+  byte elements;
+  byte word[MONITOR_WORD_LENGTH];  // current word, encoded as by morseEncodeChar()
+  byte wordLength;
+  byte wordFlags;
+  int low;                // analog: levels of space and mark, slowly moving towards each other
+  int high;
+  byte samples;
+  MonitorStatus status;
+};
+
+static MonitorDecoder decoders[BEACON_COUNT];
+static byte monitorCount = 0;
+
+void monitorInit()
+{
+  for(int i = 0; i < BEACON_COUNT; i++)
+  {
+    decoders[i].input = MONITOR_NONE;
+  }
+  monitorCount = 0;
+}
+
+/*!
+ * Start checking what a beacon sends. Call after monitorInit(), when the beacon has its speed.
+ *
+ * \param beacon_nr  Number of the beacon
+ * \param input      digital pin number, MONITOR_ANALOG(channel), or MONITOR_NONE to stop checking
+ */
+void monitorAttach(int beacon_nr, byte input)
+{
+  if((beacon_nr < 0) || (beacon_nr >= BEACON_COUNT))
+  {
+    return;
+  }
+  MonitorDecoder &d = decoders[beacon_nr];
+  if((d.input == MONITOR_NONE) != (input == MONITOR_NONE))
+  {
+    monitorCount += (input == MONITOR_NONE) ? -1 : 1;
+  }
+  memset(&d, 0, sizeof(d));
+  d.input = input;
+  d.dot = 1200 / beacons[beacon_nr].getSpeed();
+  d.low = 1023;
+  d.sampled = millis();
+  if((input != MONITOR_NONE) && !(input & MONITOR_ANALOG(0)))
+  {
+    pinMode(input, INPUT);
+  }
+}
+
+static boolean sample(MonitorDecoder &d)
+{
+  if(!(d.input & MONITOR_ANALOG(0)))
+  {
+    return digitalRead(d.input) == HIGH;
+  }
+  int v = keyedAdcAnalogRead(d.input - MONITOR_ANALOG(0));
+  if(v > d.high)
+  {
+    d.high = v;
+  }
+  if(v < d.low)
+  {
+    d.low = v;
+  }
+  int swing = d.high - d.low;
+  if(swing < MONITOR_ANALOG_MIN_SWING)
+  {
+    return false;
+  }
+  // Forget old extremes, one step every 16 samples. Some hysteresis around the middle.
+  if((++d.samples & 15) == 0)
+  {
+    d.high--;
+    d.low++;
+  }
+  int middle = d.low + swing / 2;
+  return d.mark ? (v > middle - swing / 8) : (v > middle + swing / 8);
+}
+
+static void addText(MonitorDecoder &d, char c)
+{
+  size_t len = strlen(d.status.text);
+  if(len == MONITOR_TEXT_LENGTH)
+  {
+    memmove(d.status.text, d.status.text + 1, --len);
+  }
+  d.status.text[len] = c;
+  d.status.text[len + 1] = 0;
+}
+
+static void endCharacter(MonitorDecoder &d)
+{
+  byte code = 0;
+  if(d.elements <= 6)
+  {
+    code = (0xFF << (d.elements + 1)) | d.code;  // Filler and a 0 in front, as in morseEncodeChar()
+  }
+  char c = code ? morseDecodeChar(code) : 0;
+  if(c == 0)
+  {
+    d.wordFlags |= WORD_BAD;
+    c = '*';
+  }
+  if(d.wordLength < MONITOR_WORD_LENGTH)
+  {
+    d.word[d.wordLength++] = code;
+  }
+  else
+  {
+    d.wordFlags |= WORD_LONG;
+  }
+  addText(d, c);
+  d.code = 0;
+  d.elements = 0;
+}
+
+// Look for the word in the messages the beacon may be sending
+static void endWord(int beacon_nr, MonitorDecoder &d)
+{
+  d.status.words++;
+  if(d.wordFlags & WORD_GAP)
+  {
+    d.status.unchecked++;
+  }
+  else if(d.wordFlags & WORD_BAD)
+  {
+    d.status.errors++;
+  }
+  else
+  {
+    boolean found = false;
+    boolean streamed = false;
+    for(int i = 0; (i <= BEACON_DEFMSG) && !found; i++)
+    {
+      if(isBeaconMessageStreamed(beacon_nr, i))
+      {
+        streamed = true;
+        continue;
+      }
+      const byte *encoded = getEncodedBeaconMessage(beacon_nr, i);
+      found = encoded && morseMessageHasWord(encoded, d.word, d.wordLength);
+    }
+    if(!found)
+    {
+      if(streamed || (d.wordFlags & WORD_LONG))
+      {
+        d.status.unchecked++;
+      }
+      else
+      {
+        d.status.errors++;
+      }
+    }
+  }
+  addText(d, ' ');
+  d.wordLength = 0;
+  d.wordFlags = 0;
+}
+
+static void endSpace(int beacon_nr, MonitorDecoder &d, unsigned long length)
+{
+  if(d.elements && (length > SHORT_LIMIT * d.dot))
+  {
+    endCharacter(d);
+  }
+  if(d.wordLength && (length > LONG_LIMIT * d.dot))
+  {
+    endWord(beacon_nr, d);
+  }
+}
+
+static void endMark(int beacon_nr, MonitorDecoder &d, unsigned long length)
+{
+  if(length > LONG_LIMIT * d.dot)
+  {
+    // Carrier on delay, like a word gap
+    endSpace(beacon_nr, d, length);
+    return;
+  }
+  // Follow the speed, from the dots and the dashes
+  unsigned dotLength = length;
+  d.code <<= 1;
+  if(length > SHORT_LIMIT * d.dot)
+  {
+    d.code |= 1;
+    dotLength /= 3;
+  }
+  d.elements++;
+  d.dot = (3 * d.dot + dotLength + 2) / 4;
+  if(d.dot < 1200 / BEACON_MAX_WPM / 2)
+  {
+    d.dot = 1200 / BEACON_MAX_WPM / 2;
+  }
+  if(d.dot > 2 * 1200 / BEACON_MIN_WPM)
+  {
+    d.dot = 2 * 1200 / BEACON_MIN_WPM;
+  }
+  d.status.wpm = 1200 / d.dot;
+}
+
+static void poll(int beacon_nr, MonitorDecoder &d)
+{
+  boolean level = sample(d);
+  unsigned long now = millis();
+  if(now - d.sampled > d.dot)
+  {
+    // The main loop was busy: elements may have been missed, and the one going on is longer than measured.
+    // A word that was going on is not checked, the decoder starts over with the next element.
+    if(d.elements || d.wordLength || d.mark || level)
+    {
+      d.wordFlags |= WORD_GAP;
+      d.code = 0;
+      d.elements = 0;
+    }
+    d.cut = true;
+    d.mark = level;
+    d.edge = now;
+  }
+  d.sampled = now;
+  unsigned long length = now - d.edge;
+  if(level != d.mark)
+  {
+    if(d.cut)
+    {
+      d.cut = false;
+    }
+    else if(d.mark)
+    {
+      endMark(beacon_nr, d, length);
+    }
+    else
+    {
+      endSpace(beacon_nr, d, length);
+    }
+    d.mark = level;
+    d.edge = now;
+  }
+  else if(!level)
+  {
+    // The last character and word of a message end without a next mark
+    endSpace(beacon_nr, d, length);
+  }
+}
+
+/*!
+ * Sample all monitor inputs once and decode them
+ */
+void monitorTick()
+{
+  for(int i = 0; i < BEACON_COUNT; i++)
+  {
+    if(decoders[i].input != MONITOR_NONE)
+    {
+      poll(i, decoders[i]);
+    }
+  }
+}
+
+/*!
+ * Spend some time in the main loop sampling the monitor inputs and decoding them.
+ * Takes the place of a delay(), so the decoders only use time the main loop has to spare.
+ * Samples are at most a few milliseconds apart, unless the rest of the main loop takes long. A word that had
+ * a longer pause than a dot between two samples is not checked.
+ *
+ * \param ms  time to spend
+ */
+void monitorIdle(unsigned long ms)
+{
+  if(monitorCount == 0)
+  {
+    delay(ms);
+    return;
+  }
+  unsigned long start = millis();
+  do
+  {
+    monitorTick();
+  } while(millis() - start < ms);
+}
+
+/*!
+ * Get what the decoder of a beacon found so far
+ *
+ * \return false if the beacon has no monitor input
+ */
+bool monitorGet(int beacon_nr, MonitorStatus *dest)
+{
+  if((beacon_nr < 0) || (beacon_nr >= BEACON_COUNT) || (decoders[beacon_nr].input == MONITOR_NONE))
+  {
+    return false;
+  }
+  *dest = decoders[beacon_nr].status;
+  return true;
+}
@@ -0,0 +1,27 @@
+#ifndef MONITOR_H_
+#define MONITOR_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// Loopback decoder: listens to what a beacon really sent, on a digital pin or an RF detector on an
+// analog channel, decodes it and checks every decoded word against the messages of the beacon.
+#define MONITOR_NONE      0xFF
+#define MONITOR_ANALOG(i) (0x80 + (i))  // analog channel i, otherwise a digital pin number
+
+struct MonitorStatus
+{
+  unsigned long words;      // words decoded
+  unsigned long errors;     // words that are in none of the messages of the beacon
+  unsigned long unchecked;  // words that could not be checked, while a streamed message is sent or the main loop was busy
+  byte wpm;                 // speed measured from the dots
+  char text[MONITOR_TEXT_LENGTH + 1];  // last decoded text, '*' for an unknown character
+};
+
+void monitorInit();
+void monitorAttach(int beacon_nr, byte input);
+void monitorTick();
+void monitorIdle(unsigned long ms);
+bool monitorGet(int beacon_nr, MonitorStatus *dest);
+
+#endif
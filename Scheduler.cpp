@@ -0,0 +1,589 @@
+#include "Scheduler.h"
+#include "Config.h"
+#include "BeaconController.h"
+#include "ControlPanel.h"
+#include <Arduino.h>
+#include <TimeLib.h>
+#include <string.h>
+
+// The timed messages start exactly at the events of the schedule of their beacon. Without a schedule of its own,
+// a beacon sends H00 ... H45 at the quarter hours, in the style of time-sequenced beacon networks.
+// The default message is repeated in between, as long as it ends before the next event.
+// Without a default message to fill the time, a timed message is queued this long before it starts
+#define SLOT_ARM_SECONDS 60
+#define MINUTES_PER_DAY 1440
+// A default message too long to be encoded at once is read from the SD card in parts of this many characters,
+// just before they are needed
+#define STREAM_PART_LENGTH 13
+
+static_assert(BEACON_PART_SEGMENTS >= 16, "a part has room for the longest character");
+static_assert(STREAM_PART_LENGTH < BEACON_MESSAGE_LENGTH, "a part of a streamed message is encoded like a message");
+
+extern Beacon beacons[BEACON_COUNT];
+
+// A message is compiled a part at a time, into the queue of its beacon (see Beacon::queueIndex()). The message
+// being compiled is a copy, so it does not change or move in the message pool before its last part.
+static byte beaconSegments[BEACON_COUNT][BEACON_QUEUE_LENGTH][BEACON_PART_SEGMENTS];
+static byte sendingMessage[BEACON_COUNT][BEACON_MESSAGE_LENGTH];
+static MorseCompiler compilers[BEACON_COUNT];
+
+static BeaconTime queueEnd[BEACON_COUNT];  // estimated time the queued messages are finished
+// What queueEnd is worked out from again whenever a beacon finishes a part, so an estimate that was off does not
+// add up: the length of each queued part, and of the rest of the message that is not queued yet, in dots.
+static unsigned partDots[BEACON_COUNT][BEACON_QUEUE_LENGTH];
+static unsigned long dotsLeft[BEACON_COUNT];
+static byte partsFinished[BEACON_COUNT];    // Beacon::queueFinished() when queueEnd was worked out
+static time_t armedSlot[BEACON_COUNT];     // start of the last event whose message has been queued
+
+// The schedule entries of all beacons, those of beacon i at firstEntry[i] ... firstEntry[i+1]-1.
+// heap[] has the same ranges, each a min-heap of the entries of one beacon by the time of their next event.
+// The next event of a beacon is then always at heap[firstEntry[i]], and the main loop only compares that with
+// the clock. An entry moves on to its following event when its message is queued, or when the event has passed.
+static_assert(SCHEDULE_ENTRIES >= 4 * BEACON_COUNT, "room for the default schedules of all beacons");
+static_assert(SCHEDULE_BEACON_ENTRIES < 128, "the entries of one beacon are counted in a byte");
+static ScheduleEntry schedule[SCHEDULE_ENTRIES];
+static uint32_t eventTime[SCHEDULE_ENTRIES];  // next event of each entry, SCHEDULE_NEVER if there is none
+static uint16_t heap[SCHEDULE_ENTRIES];
+static uint16_t firstEntry[BEACON_COUNT + 1];
+static uint32_t eventsChecked = 0;  // time of the last look at the events, to notice when the clock goes back
+
+// Where a streamed default message continues
+struct MessageStream
+{
+  unsigned long pos;  // position of the next part in the message file
+  byte mode;          // power mode at the start of the next part
+  bool active;        // false to start at the beginning
+};
+static MessageStream streams[BEACON_COUNT];
+
+static int prepareNext = 0;  // beacon whose next slot message is prepared at the next schedulerTick()
+
+static bool timeBefore(const BeaconTime &a, const BeaconTime &b)
+{
+  return (a.seconds < b.seconds) || ((a.seconds == b.seconds) && (a.ticks < b.ticks));
+}
+
+static void addTicks(BeaconTime &t, unsigned long ticks)
+{
+  ticks += t.ticks;
+  t.seconds += ticks / BEACON_TICK_RATE;
+  t.ticks = ticks % BEACON_TICK_RATE;
+}
+
+/*!
+ * Get the schedule of a beacon that has none of its own: H00 ... H45 at the quarter hours
+ *
+ * \param dest  room for 4 entries
+ *
+ * \return the number of entries
+ */
+byte scheduleDefault(ScheduleEntry *dest)
+{
+  for(byte i = 0; i < 4; i++)
+  {
+    dest[i].message = BEACON_H00MSG + i;
+    dest[i].type = SCHEDULE_CRON;
+    dest[i].cron.minute = 15 * i;
+    dest[i].cron.hour = SCHEDULE_ANY;
+    dest[i].cron.days = SCHEDULE_ALL_DAYS;
+  }
+  return 4;
+}
+
+/*!
+ * Check an entry before it goes into a schedule
+ */
+bool scheduleValid(const ScheduleEntry &entry)
+{
+  if(entry.message > BEACON_H45MSG)
+  {
+    return false;
+  }
+  switch(entry.type)
+  {
+    case SCHEDULE_CRON:
+      return ((entry.cron.minute < 60) || (entry.cron.minute == SCHEDULE_ANY)) &&
+             ((entry.cron.hour < 24) || (entry.cron.hour == SCHEDULE_ANY)) &&
+             (entry.cron.days & SCHEDULE_ALL_DAYS) && !(entry.cron.days & ~SCHEDULE_ALL_DAYS);
+    case SCHEDULE_INTERVAL:
+      return (entry.interval.period > 0) && (entry.interval.offset < entry.interval.period);
+    case SCHEDULE_ONCE:
+      return (entry.at % 60) == 0;
+  }
+  return false;
+}
+
+// Time of the first event of an entry after the given time, SCHEDULE_NEVER if there is none
+static uint32_t nextEventTime(const ScheduleEntry &e, uint32_t after)
+{
+  uint32_t minutes = after / 60 + 1;
+  switch(e.type)
+  {
+    case SCHEDULE_ONCE:
+      return (e.at > after) ? e.at : SCHEDULE_NEVER;
+    case SCHEDULE_INTERVAL:
+      minutes += (e.interval.period - (minutes - e.interval.offset) % e.interval.period) % e.interval.period;
+      return minutes * 60;
+    case SCHEDULE_CRON:
+      // The rest of today and the next 7 days
+      for(byte d = 0; d < 8; d++)
+      {
+        uint32_t day = minutes / MINUTES_PER_DAY;
+        if(e.cron.days & (1 << ((day + 4) % 7)))  // 1 January 1970 was a Thursday
+        {
+          unsigned minute = minutes % MINUTES_PER_DAY;
+          for(unsigned hour = minute / 60; hour < 24; hour++)
+          {
+            if((e.cron.hour != SCHEDULE_ANY) && (hour != e.cron.hour))
+            {
+              continue;
+            }
+            unsigned first = (hour == minute / 60) ? minute % 60 : 0;
+            if(e.cron.minute == SCHEDULE_ANY)
+            {
+              return ((day * MINUTES_PER_DAY) + hour * 60 + first) * 60;
+            }
+            if(e.cron.minute >= first)
+            {
+              return ((day * MINUTES_PER_DAY) + hour * 60 + e.cron.minute) * 60;
+            }
+          }
+        }
+        minutes = (day + 1) * MINUTES_PER_DAY;
+      }
+      break;
+  }
+  return SCHEDULE_NEVER;
+}
+
+// Move an entry down the heap of a beacon, after its event time went up
+static void siftDown(uint16_t first, byte count, byte pos)
+{
+  uint16_t entry = heap[first + pos];
+  while(true)
+  {
+    byte child = 2 * pos + 1;
+    if(child >= count)
+    {
+      break;
+    }
+    if((child + 1 < count) && (eventTime[heap[first + child + 1]] < eventTime[heap[first + child]]))
+    {
+      child++;
+    }
+    if(eventTime[heap[first + child]] >= eventTime[entry])
+    {
+      break;
+    }
+    heap[first + pos] = heap[first + child];
+    pos = child;
+  }
+  heap[first + pos] = entry;
+}
+
+// Work out the next event of every entry of a beacon, and put them in order
+static void buildEvents(int beacon_nr, uint32_t after)
+{
+  uint16_t first = firstEntry[beacon_nr];
+  byte count = firstEntry[beacon_nr + 1] - first;
+  for(uint16_t i = first; i < first + count; i++)
+  {
+    heap[i] = i;
+    eventTime[i] = nextEventTime(schedule[i], after);
+  }
+  for(byte pos = count / 2; pos-- > 0; )
+  {
+    siftDown(first, count, pos);
+  }
+}
+
+// Move the entry with the next event of a beacon on to its first event after the given time
+static void skipEvent(int beacon_nr, uint32_t after)
+{
+  uint16_t first = firstEntry[beacon_nr];
+  eventTime[heap[first]] = nextEventTime(schedule[heap[first]], after);
+  siftDown(first, firstEntry[beacon_nr + 1] - first, 0);
+}
+
+// Get the entry with the next event of a beacon, after moving on the events that have passed.
+// While no event is due, this is a single comparison.
+static const ScheduleEntry *upcomingEvent(int beacon_nr, uint32_t now, uint32_t *at)
+{
+  uint16_t first = firstEntry[beacon_nr];
+  if(first == firstEntry[beacon_nr + 1])
+  {
+    return 0;
+  }
+  while(eventTime[heap[first]] <= now)
+  {
+    skipEvent(beacon_nr, now);
+  }
+  *at = eventTime[heap[first]];
+  return (*at == SCHEDULE_NEVER) ? 0 : &schedule[heap[first]];
+}
+
+/*!
+ * Replace the schedule of a beacon. The entries of all beacons share SCHEDULE_ENTRIES places.
+ *
+ * \param beacon_nr  Number of the beacon
+ * \param entries    the new schedule, checked with scheduleValid()
+ * \param count      number of entries, 0 for a beacon without timed messages
+ *
+ * \return false if there is no room for the entries, the schedule is then unchanged
+ */
+bool schedulerSetEntries(int beacon_nr, const ScheduleEntry *entries, byte count)
+{
+  if((beacon_nr < 0) || (beacon_nr >= BEACON_COUNT))
+  {
+    return false;
+  }
+  uint16_t first = firstEntry[beacon_nr];
+  byte old = firstEntry[beacon_nr + 1] - first;
+  uint16_t end = firstEntry[BEACON_COUNT];
+  if(end - old + count > SCHEDULE_ENTRIES)
+  {
+    return false;
+  }
+  // The entries of the beacons after this one move, with their events and heaps
+  uint16_t rest = end - first - old;
+  memmove(&schedule[first + count], &schedule[first + old], rest * sizeof(schedule[0]));
+  memmove(&eventTime[first + count], &eventTime[first + old], rest * sizeof(eventTime[0]));
+  memmove(&heap[first + count], &heap[first + old], rest * sizeof(heap[0]));
+  for(uint16_t i = first + count; i < first + count + rest; i++)
+  {
+    heap[i] += count - old;
+  }
+  for(int i = beacon_nr + 1; i <= BEACON_COUNT; i++)
+  {
+    firstEntry[i] += count - old;
+  }
+  memcpy(&schedule[first], entries, count * sizeof(schedule[0]));
+  // Not again the event whose message is queued already
+  BeaconTime now;
+  beaconClockGet(&now);
+  buildEvents(beacon_nr, (armedSlot[beacon_nr] > now.seconds) ? armedSlot[beacon_nr] : now.seconds);
+  return true;
+}
+
+/*!
+ * Get the schedule of a beacon
+ *
+ * \return the number of entries copied to dest, at most max
+ */
+byte schedulerGetEntries(int beacon_nr, ScheduleEntry *dest, byte max)
+{
+  if((beacon_nr < 0) || (beacon_nr >= BEACON_COUNT))
+  {
+    return 0;
+  }
+  byte count = firstEntry[beacon_nr + 1] - firstEntry[beacon_nr];
+  if(count > max)
+  {
+    count = max;
+  }
+  memcpy(dest, &schedule[firstEntry[beacon_nr]], count * sizeof(schedule[0]));
+  return count;
+}
+
+/*!
+ * Get the number of entries in the schedule of a beacon
+ */
+byte schedulerEntryCount(int beacon_nr)
+{
+  if((beacon_nr < 0) || (beacon_nr >= BEACON_COUNT))
+  {
+    return 0;
+  }
+  return firstEntry[beacon_nr + 1] - firstEntry[beacon_nr];
+}
+
+/*!
+ * Get the time of the next event of a beacon whose message is not queued yet
+ *
+ * \return the time, SCHEDULE_NEVER if there is none or the time is not set
+ */
+uint32_t schedulerNextEvent(int beacon_nr)
+{
+  if((beacon_nr < 0) || (beacon_nr >= BEACON_COUNT) || (timeStatus() == timeNotSet) ||
+     (firstEntry[beacon_nr] == firstEntry[beacon_nr + 1]))
+  {
+    return SCHEDULE_NEVER;
+  }
+  return eventTime[heap[firstEntry[beacon_nr]]];
+}
+
+static void messageError(int beacon_nr)
+{
+  Serial.print(F("Error compiling message for beacon nr "));
+  Serial.print(beacon_nr);
+  Serial.println(":");
+  Serial.println(morseGetError());
+  while(true)
+  {
+    // General strike! We demand better code!
+  }
+}
+
+// Get ready to send an encoded message
+static void loadMessage(int beacon_nr, const byte *encoded, byte mode, bool last)
+{
+  memcpy(sendingMessage[beacon_nr], encoded, morseEncodedLength(encoded));
+  morseCompileStart(compilers[beacon_nr], sendingMessage[beacon_nr], mode, last);
+}
+
+// Read and encode the next part of a streamed default message, and get ready to send it. Halts on errors.
+static void loadStreamPart(int beacon_nr, MessageStream &stream)
+{
+  char text[STREAM_PART_LENGTH + 1];
+  if(!stream.active)
+  {
+    stream.pos = 0;
+    stream.mode = 0;
+  }
+  stream.active = readBeaconMessage(beacon_nr, BEACON_DEFMSG, &stream.pos, text, sizeof(text));
+  if(morseEncodeMessage(sendingMessage[beacon_nr], text, STREAM_PART_LENGTH + 1)==false)
+  {
+    messageError(beacon_nr);
+  }
+  morseCompileStart(compilers[beacon_nr], sendingMessage[beacon_nr], stream.mode, !stream.active);
+}
+
+// Length of the loaded message in dots. It is compiled once in the next free queue position to find out.
+// Halts on errors.
+static unsigned long messageDots(int beacon_nr, byte *endMode)
+{
+  MorseCompiler c = compilers[beacon_nr];
+  byte *segments = beaconSegments[beacon_nr][beacons[beacon_nr].queueIndex()];
+  unsigned long dots = 0;
+  while(!c.done)
+  {
+    if(morseCompileNext(c, segments, BEACON_PART_SEGMENTS)==false)
+    {
+      messageError(beacon_nr);
+    }
+    dots += morseMessageDots(segments);
+  }
+  if(endMode)
+  {
+    *endMode = c.mode;
+  }
+  return dots;
+}
+
+// Compile and queue the next part of the loaded message. Halts on errors.
+static void queuePart(int beacon_nr, time_t startAt)
+{
+  byte index = beacons[beacon_nr].queueIndex();
+  byte *segments = beaconSegments[beacon_nr][index];
+  if(morseCompileNext(compilers[beacon_nr], segments, BEACON_PART_SEGMENTS)==false)
+  {
+    messageError(beacon_nr);
+  }
+  // A sensor value may have changed since the message was measured
+  unsigned long dots = morseMessageDots(segments);
+  partDots[beacon_nr][index] = dots;
+  dotsLeft[beacon_nr] = compilers[beacon_nr].done ? 0 : (dotsLeft[beacon_nr] > dots) ? dotsLeft[beacon_nr] - dots : 0;
+  beacons[beacon_nr].queueMessage(segments, startAt);
+}
+
+// Start sending the loaded message, its length is added to the queue
+static void queueMessage(int beacon_nr, unsigned long dots, time_t startAt)
+{
+  if(startAt && (queueEnd[beacon_nr].seconds < startAt))
+  {
+    queueEnd[beacon_nr].seconds = startAt;
+    queueEnd[beacon_nr].ticks = 0;
+  }
+  addTicks(queueEnd[beacon_nr], morseDotsToTicks(dots, beacons[beacon_nr].getSpeed()));
+  dotsLeft[beacon_nr] = dots;
+  queuePart(beacon_nr, startAt);
+}
+
+// Work out queueEnd again from the parts that are left, when the beacon has just started the one at
+// Beacon::queueFinished(). Only the time since then is not known, at most one pass of the main loop.
+static void updateQueueEnd(int beacon_nr, const BeaconTime &now)
+{
+  Beacon &beacon = beacons[beacon_nr];
+  byte finished = beacon.queueFinished();
+  byte queued = beacon.queueQueued();
+  BeaconTime end = now;
+  unsigned long dots = 0;
+  for(byte n = finished; n != queued; n++)
+  {
+    time_t startAt = beacon.queueStartAt(n);
+    if(startAt)
+    {
+      addTicks(end, morseDotsToTicks(dots, beacon.getSpeed()));
+      dots = 0;
+      if(end.seconds < startAt)
+      {
+        end.seconds = startAt;
+        end.ticks = 0;
+      }
+    }
+    dots += partDots[beacon_nr][n & (BEACON_QUEUE_LENGTH - 1)];
+  }
+  addTicks(end, morseDotsToTicks(dots + dotsLeft[beacon_nr], beacon.getSpeed()));
+  queueEnd[beacon_nr] = end;
+  partsFinished[beacon_nr] = finished;
+}
+
+/*!
+ * Queue the next part of the message being sent, or start the next message if there is something to send.
+ *
+ * \return true if a part was queued
+ */
+static bool queueNextMessage(int beacon_nr, const BeaconTime &now)
+{
+  if(!compilers[beacon_nr].done)
+  {
+    queuePart(beacon_nr, 0);
+    return true;
+  }
+  time_t slot = 0;
+  byte message = 0;
+  if(timeStatus() != timeNotSet)
+  {
+    uint32_t at;
+    const ScheduleEntry *event = upcomingEvent(beacon_nr, now.seconds, &at);
+    if(event && isBeaconMessageSending(beacon_nr, event->message))
+    {
+      slot = at;
+      message = event->message;
+    }
+  }
+
+  bool loaded = false;
+  unsigned long dots = 0;
+  MessageStream resume = streams[beacon_nr];
+  if(isBeaconMessageStreamed(beacon_nr, BEACON_DEFMSG))
+  {
+    loadStreamPart(beacon_nr, streams[beacon_nr]);
+    dots = messageDots(beacon_nr, &streams[beacon_nr].mode);
+    loaded = true;
+  }
+  else
+  {
+    streams[beacon_nr].active = false;
+    const byte *encoded = getEncodedBeaconMessage(beacon_nr, BEACON_DEFMSG);
+    if(encoded)
+    {
+      loadMessage(beacon_nr, encoded, 0, true);
+      dots = messageDots(beacon_nr, 0);
+      loaded = true;
+    }
+  }
+  if(loaded)
+  {
+    BeaconTime end = queueEnd[beacon_nr];
+    addTicks(end, morseDotsToTicks(dots, beacons[beacon_nr].getSpeed()));
+    if((slot == 0) || (end.seconds < slot) || ((end.seconds == slot) && (end.ticks == 0)))
+    {
+      queueMessage(beacon_nr, dots, 0);
+      return true;
+    }
+    // The default message would run into the slot: send the slot message instead.
+    // A streamed message continues where it was after that.
+    streams[beacon_nr] = resume;
+  }
+  else if((slot == 0) || ((slot - now.seconds) > SLOT_ARM_SECONDS))
+  {
+    return false;
+  }
+
+  armedSlot[beacon_nr] = slot;
+  skipEvent(beacon_nr, slot);
+  loadMessage(beacon_nr, getEncodedBeaconMessage(beacon_nr, message), 0, true);
+  queueMessage(beacon_nr, messageDots(beacon_nr, 0), slot);
+  return true;
+}
+
+// Read and encode the message of the next event of one beacon per call, so it is ready in memory when it is
+// queued. The SD card is then only read in the idle time of the main loop, after a change of the message,
+// and not in the middle of filling the queues.
+static void prepareNextSlot(const BeaconTime &now)
+{
+  int beacon_nr = prepareNext;
+  prepareNext = (prepareNext + 1) % BEACON_COUNT;
+  if(timeStatus() == timeNotSet)
+  {
+    return;
+  }
+  uint32_t at;
+  const ScheduleEntry *event = upcomingEvent(beacon_nr, now.seconds, &at);
+  if(event)
+  {
+    prepareBeaconMessage(beacon_nr, event->message);
+  }
+}
+
+/*!
+ * Give every beacon the default schedule and queue the first messages. Call after the beacons are
+ * initialized, and after controlPanelRestore(). controlPanelInit() replaces the schedules later.
+ */
+void schedulerInit()
+{
+  ScheduleEntry entries[4];
+  byte count = scheduleDefault(entries);
+  memset(firstEntry, 0, sizeof(firstEntry));
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    beaconClockGet(&queueEnd[i]);
+    armedSlot[i] = 0;
+    streams[i].active = false;
+    compilers[i].done = true;
+    dotsLeft[i] = 0;
+    partsFinished[i] = beacons[i].queueFinished();
+    schedulerSetEntries(i, entries, count);
+  }
+  eventsChecked = 0;
+  schedulerTick();
+}
+
+/*!
+ * Keep the message queues filled, so the beacons never have to wait for the next message,
+ * and prepare the next timed message of one beacon.
+ */
+void schedulerTick()
+{
+  BeaconTime now;
+  beaconClockGet(&now);
+  if((uint32_t)now.seconds < eventsChecked)
+  {
+    // The clock was set back: the next events are too far ahead
+    for(int i=0; i<BEACON_COUNT; i++)
+    {
+      armedSlot[i] = 0;
+      buildEvents(i, now.seconds);
+    }
+  }
+  eventsChecked = now.seconds;
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    if(!beacons[i].getEnabled())
+    {
+      // A stopped beacon drops its queue, it starts with a new message when it runs again
+      compilers[i].done = true;
+      dotsLeft[i] = 0;
+      queueEnd[i] = now;
+      partsFinished[i] = beacons[i].queueFinished();
+      continue;
+    }
+    if(beacons[i].queueFinished() != partsFinished[i])
+    {
+      updateQueueEnd(i, now);
+    }
+    if(timeBefore(queueEnd[i], now))
+    {
+      queueEnd[i] = now;  // the queue ran empty
+    }
+    while(beacons[i].queueSpace())
+    {
+      if(!queueNextMessage(i, now))
+      {
+        break;
+      }
+    }
+  }
+  prepareNextSlot(now);
+}
@@ -0,0 +1,47 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <Arduino.h>
+#include "Config.h"
+
+// A schedule entry says when one of the timed messages (BEACON_H00MSG ... BEACON_H45MSG) of a beacon is sent.
+// The message starts exactly at the time of the event, the default message fills the time in between.
+// All times are whole minutes, in UTC.
+#define SCHEDULE_CRON     0  // at a minute of an hour, on some days of the week
+#define SCHEDULE_INTERVAL 1  // every so many minutes
+#define SCHEDULE_ONCE     2  // at a date and time
+#define SCHEDULE_ANY      0xFF        // any minute or hour
+#define SCHEDULE_ALL_DAYS 0x7F
+#define SCHEDULE_NEVER    0xFFFFFFFFUL
+struct ScheduleEntry
+{
+  byte message;  // BEACON_H00MSG ... BEACON_H45MSG
+  byte type;
+  union
+  {
+    struct
+    {
+      byte minute;  // 0 ... 59 or SCHEDULE_ANY
+      byte hour;    // 0 ... 23 or SCHEDULE_ANY
+      byte days;    // bit 0 Sunday ... bit 6 Saturday
+    } cron;
+    struct
+    {
+      uint16_t period;  // minutes, at least 1
+      uint16_t offset;  // at the minutes since 1970 where minutes % period == offset
+    } interval;
+    uint32_t at;        // the time of a SCHEDULE_ONCE entry
+  };
+};
+
+void schedulerInit();
+void schedulerTick();
+
+byte scheduleDefault(ScheduleEntry *dest);
+bool scheduleValid(const ScheduleEntry &entry);
+bool schedulerSetEntries(int beacon_nr, const ScheduleEntry *entries, byte count);
+byte schedulerGetEntries(int beacon_nr, ScheduleEntry *dest, byte max);
+byte schedulerEntryCount(int beacon_nr);
+uint32_t schedulerNextEvent(int beacon_nr);
+
+#endif
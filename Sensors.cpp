@@ -1,5 +1,7 @@
 #include "Sensors.h"
 #include "Config.h"
+#include "BeaconController.h"
+#include "KeyedAdc.h"
 #include <Arduino.h>
 
 #include <OneWire.h>
@@ -12,12 +14,60 @@ static int analogInputs[NUM_ANALOG_CHANNELS]; // 0-1023
 static int temperatureInputs[NUM_TEMPERATURE_CHANNELS]; // in 1 degrees C
 static int temperatureDeviceCount = 0;
 
+// Morse encoded sensor values for the beacons. Updated in the buffer that is not active, then made active,
+// so the beacon interrupt always finds a complete value.
+static byte morseValues[SENSOR_COUNT][2][SENSOR_MORSE_LENGTH];
+static volatile byte morseActive[SENSOR_COUNT];
+
 /* sensorsTick state */
 static unsigned long lastConversion = 0;
 static const int conversionInterval = 1000; // every second
 static int currentAnalogChannel = 0;
 /* end sensorTick state */
 
+// A value is only characters, without $-codes. It is not encoded with morseEncodeMessage(), which would
+// replace the error of the last message for morseGetError().
+static bool encodeValue(byte *dest, const char *str)
+{
+  byte i;
+  for(i = 0; str[i]; i++)
+  {
+    if(i == SENSOR_MORSE_LENGTH - 1)
+    {
+      return false;
+    }
+    dest[i] = morseEncodeChar(str[i]);
+    if(dest[i] == 0)
+    {
+      return false;
+    }
+  }
+  dest[i] = MORSE_END;
+  return true;
+}
+
+/*!
+ * Encode the current value of a sensor for the beacons. A value that can not be encoded leaves the
+ * previous one in use.
+ */
+static void updateSensorMorse(int sensor)
+{
+  char str[SENSOR_MORSE_LENGTH];
+  if(sensor < NUM_ANALOG_CHANNELS)
+  {
+    readAnalogSensor(str, sensor);
+  }
+  else
+  {
+    readTemperatureSensor(str, sensor - NUM_ANALOG_CHANNELS);
+  }
+  byte next = morseActive[sensor] ^ 1;
+  if(encodeValue(morseValues[sensor][next], str))
+  {
+    morseActive[sensor] = next;
+  }
+}
+
 void sensorsInit()
 {
   sensors.begin();
@@ -32,12 +82,16 @@ void sensorsInit()
   int i;
   for(i=0; i<NUM_ANALOG_CHANNELS; i++)
   {
-    analogInputs[i] = analogRead(i);
+    analogInputs[i] = keyedAdcAnalogRead(i);
   }
   for(i=0; i<temperatureDeviceCount; i++)
   {
     temperatureInputs[i] = sensors.getTempCByIndex(i);
   }
+  for(i=0; i<SENSOR_COUNT; i++)
+  {
+    updateSensorMorse(i);
+  }
   lastConversion = millis();
 }
 
@@ -54,12 +108,14 @@ void sensorsTick()
     for(int i=0; i<temperatureDeviceCount; i++)
     {
       temperatureInputs[i] = sensors.getTempCByIndex(i);
+      updateSensorMorse(SENSOR_TEMPERATURE(i));
     }
     // Get a new conversion started
     sensors.requestTemperatures();
     lastConversion = millis();
   }
-  analogInputs[currentAnalogChannel]=analogRead(currentAnalogChannel);
+  analogInputs[currentAnalogChannel]=keyedAdcAnalogRead(currentAnalogChannel);
+  updateSensorMorse(SENSOR_ANALOG(currentAnalogChannel));
   currentAnalogChannel++;
   if(currentAnalogChannel==NUM_ANALOG_CHANNELS)
   {
@@ -67,27 +123,6 @@ void sensorsTick()
   }
 }
 
-/*!
- * Give the worst case string size of a temperature channel 
- *
- * \param channel  Number of the sensor
- *
- * \return The length of the string just written (not including the terminating zero)
- */
-int maxAnalogStrSize(int channel)
-{
-  if((channel>=0) && (channel<NUM_ANALOG_CHANNELS))
-  {
-    // Format will be eg. "4V2"
-    return 3;
-  }
-  else
-  {
-    // write "ERR"
-    return 3;
-  }
-}
-
 /*!
  * Read the voltage of an analog input as a null-terminated string value. Returns the length of the string.
  *
@@ -122,27 +157,6 @@ int readAnalogSensor(char *dest, int channel)
   }
 }
 
-/*!
- * Give the worst case string size of a temperature channel 
- *
- * \param channel  Number of the sensor
- *
- * \return The length of the string just written (not including the terminating zero)
- */
-int maxTemperatureStrSize(int channel)
-{
-  if((channel>=0) && (channel<temperatureDeviceCount))
-  {
-    // Example: "-11C"
-    return 4;
-  }
-  else
-  {
-    // write "ERR"
-    return 3;
-  }
-}
-
 /*!
  * Read the temperature of a sensor as a null-terminated string value. Returns the length of the string.
  *
@@ -200,3 +214,16 @@ int readTemperatureSensor(char *dest, int channel)
   }
 }
 
+/*!
+ * Get the value of a sensor as a morse encoded message, for sending it with the beacon.
+ * Safe to call from the beacon interrupt. The value is replaced when the sensor is read again,
+ * so take a copy right away.
+ *
+ * \param sensor  SENSOR_ANALOG(channel) or SENSOR_TEMPERATURE(channel)
+ *
+ * \return the value, at most SENSOR_MORSE_LENGTH bytes including the MORSE_END
+ */
+const byte *sensorMorse(byte sensor)
+{
+  return morseValues[sensor][morseActive[sensor]];
+}
@@ -1,13 +1,24 @@
 #ifndef SENSORS_H_
 #define SENSORS_H_
 
+#include <Arduino.h>
+#include "Config.h"
+
+// Sensor numbers, for sensorMorse()
+#define SENSOR_ANALOG(i)       (i)
+#define SENSOR_TEMPERATURE(i)  (NUM_ANALOG_CHANNELS + (i))
+#define SENSOR_COUNT           (NUM_ANALOG_CHANNELS + NUM_TEMPERATURE_CHANNELS)
+
+// Longest sensor value as a morse encoded message ("-11C"), including the end code
+#define SENSOR_MORSE_LENGTH 5
+
 void sensorsInit();
 void sensorsTick();
   
-int maxAnalogStrSize(int channel);
 int readAnalogSensor(char *dest, int channel);
 
-int maxTemperatureStrSize(int channel);
 int readTemperatureSensor(char *dest, int channel);
 
+const byte *sensorMorse(byte sensor);
+
 #endif
@@ -5,6 +5,13 @@
 #include "Config.h"
 #include "Sensors.h"
 #include "ControlPanel.h"
+#include "IsrStats.h"
+#include "Monitor.h"
+#include "KeyedAdc.h"
+#include "BeaconController.h"
+#include "Json.h"
+#include "DataLog.h"
+#include <TimeLib.h>
 #include <avr/pgmspace.h>
 
 static byte mac[] = {MAC_ADDRESS};
@@ -27,7 +34,14 @@ static int HTTP_req_content_length;
  /<N>/seth15.htm?txt=<msg>  - set a text to be sent at 15 minutes past the hour
  /<N>/seth30.htm?txt=<msg>  - set a text to be sent at half past the hour
  /<N>/seth45.htm?txt=<msg>  - set a text to be sent at 15 minutes before the hour
+ POST wpm=<speed> to /<N>/index.htm - set the keying speed of beacon <N>
+ POST sched=<entry> to /<N>/index.htm - add an entry to the schedule of beacon <N>, unsched=<i> removes entry i
  /sensors.txt  - JSON formatted 
+ /isrstats.txt - JSON formatted measurements of the beacon interrupt, /isrstats.txt?reset starts over
+ /monitor.txt  - JSON formatted results of the loopback decoders, null for a beacon without monitor input
+ /power.txt    - JSON formatted power detector readings at key down and key up, null for a beacon without detectors
+ /config.json  - the settings of all beacons, see sendConfigJSON(). POST a document in the same format to change
+                 the settings of several beacons at once, or to /config.json?dryrun to only check it.
 */
 
 struct BeaconSettings
@@ -35,13 +49,20 @@ struct BeaconSettings
   bool enabled;
   char text[BEACON_MESSAGE_LENGTH];
   int textid;
+  int wpm;
+  char sched[SCHEDULE_TEXT_LENGTH];
+  int unsched;
 };
 
+static const char dayNames[] = "SuMoTuWeThFrSa";
+
 static void urldecode2(char *dst, const char *src);
 static const char *getMimeType(const char *filename);
 static bool httpRespond(EthernetClient &client);
 static void httpParseHeaderLine();
 static bool send404NotFound(EthernetClient &client, const char* filename);
+static bool processConfigJSON(EthernetClient &client);
+static bool checkConfigJSON(EthernetClient &client);
 
 
 void WebServerInit()
@@ -284,6 +305,7 @@ static bool sendSDLogFile(EthernetClient &client, const char *filename)
   char frame_buf[200];
   byte bytes_read;
   File web_file;
+  dataLogFlush();  // the file of today may have records waiting
   web_file = SD.open(filename, FILE_READ);
   if(web_file)
   {
@@ -486,6 +508,116 @@ bool sendRunningJSON(EthernetClient &client)
   return false;
 }
 
+#ifdef ENABLE_ISR_STATS
+static void sendHistogramJSON(char *frame_buf, EthernetClient &client, const char *name, const IsrHistogram &h)
+{
+  sprintf_P(frame_buf, PSTR("\"%s\":{\"min\":%u,\"max\":%u,\"buckets\":["), name, (h.min > h.max ? 0 : h.min), h.max);
+  client.write(frame_buf, strlen(frame_buf));
+  for(int i=0; i<ISR_STATS_BUCKETS; i++)
+  {
+    sprintf_P(frame_buf, PSTR("%s%lu"), (i ? "," : ""), h.buckets[i]);
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  client.write("]}", 2);
+}
+
+// Times are in Timer1 counts of count_ns nanoseconds. Bucket i holds the values of i bits, the last one everything above.
+static bool sendIsrStatsJSON(EthernetClient &client)
+{
+  char frame_buf[100];
+  IsrStats stats;
+  isrStatsGet(&stats);
+  sendDynamicHeader(frame_buf, client, "application/json");
+  sprintf_P(frame_buf, PSTR("{\"count_ns\":%lu,\"period\":%lu,\"missed_ticks\":%lu,"),
+            1000000000UL / (F_CPU / BEACON_TIMER_PRESCALER), (unsigned long)BEACON_TIMER_PERIOD, stats.missedTicks);
+  client.write(frame_buf, strlen(frame_buf));
+  sendHistogramJSON(frame_buf, client, "duration", stats.histograms[ISR_STATS_DURATION]);
+  client.write(",", 1);
+  sendHistogramJSON(frame_buf, client, "tick", stats.histograms[ISR_STATS_TICK]);
+  client.write(",", 1);
+  sendHistogramJSON(frame_buf, client, "latency", stats.histograms[ISR_STATS_LATENCY]);
+  client.write(",", 1);
+  sendHistogramJSON(frame_buf, client, "missed", stats.histograms[ISR_STATS_MISSED]);
+  client.print(F(",\"tick_max\":["));
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    sprintf_P(frame_buf, PSTR("%s%u"), (i ? "," : ""), stats.tickMax[i]);
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  client.write("]}", 2);
+  return false;
+}
+
+static bool resetIsrStats(EthernetClient &client)
+{
+  isrStatsReset();
+  return sendIsrStatsJSON(client);
+}
+#endif
+
+static bool sendMonitorJSON(EthernetClient &client)
+{
+  char frame_buf[120];
+  MonitorStatus status;
+  sendDynamicHeader(frame_buf, client, "application/json");
+  client.write("[", 1);
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    if(i>0)
+    {
+      client.write(",", 1);
+    }
+    if(monitorGet(i, &status))
+    {
+      sprintf_P(frame_buf, PSTR("{\"words\":%lu,\"errors\":%lu,\"unchecked\":%lu,\"wpm\":%u,\"text\":\"%s\"}"),
+                status.words, status.errors, status.unchecked, status.wpm, status.text);
+    }
+    else
+    {
+      strcpy_P(frame_buf, PSTR("null"));
+    }
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  client.write("]", 1);
+  return false;
+}
+
+// Power detector readings, ADC values averaged with the key down and up. Beacons without detectors are null,
+// and so is a reflected power without a detector.
+static bool sendPowerJSON(EthernetClient &client)
+{
+  char frame_buf[150];
+  KeyedAdcReading reading;
+  sendDynamicHeader(frame_buf, client, "application/json");
+  client.write("[", 1);
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    if(i>0)
+    {
+      client.write(",", 1);
+    }
+    if(!keyedAdcGet(i, &reading))
+    {
+      client.write("null", 4);
+      continue;
+    }
+    sprintf_P(frame_buf, PSTR("{\"samples_on\":%lu,\"samples_off\":%lu,\"forward_on\":%u,\"forward_off\":%u,"),
+              reading.samplesOn, reading.samplesOff, reading.forwardOn, reading.forwardOff);
+    client.write(frame_buf, strlen(frame_buf));
+    if(reading.reflected)
+    {
+      sprintf_P(frame_buf, PSTR("\"reflected_on\":%u,\"reflected_off\":%u}"), reading.reflectedOn, reading.reflectedOff);
+    }
+    else
+    {
+      strcpy_P(frame_buf, PSTR("\"reflected_on\":null,\"reflected_off\":null}"));
+    }
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  client.write("]", 1);
+  return false;
+}
+
 // TODO Could add the beacon nr to all pages and get rid of code duplication
 struct WebPage
 {
@@ -509,11 +641,595 @@ WebPage rootpages[] =
   {"/analog.txt", sendAnalogJSON},
   {"/temperature.txt", sendTemperatureJSON},
   {"/running.txt", sendRunningJSON},
+  {"/monitor.txt", sendMonitorJSON},
+  {"/power.txt", sendPowerJSON},
+  {"/config.json", processConfigJSON},
+  {"/config.json?dryrun", checkConfigJSON},
+#ifdef ENABLE_ISR_STATS
+  {"/isrstats.txt", sendIsrStatsJSON},
+  {"/isrstats.txt?reset", resetIsrStats},
+#endif
   {"/favicon.ico", sendFavicon},
   {NULL, NULL}
 };
 // TODO: /favicon.ico
 
+// Read a number of at most 5 digits, returns the position after it or 0
+static const char *parseNumber(const char *text, unsigned *value)
+{
+  if(!isdigit(*text))
+  {
+    return 0;
+  }
+  *value = 0;
+  for(byte digits = 0; isdigit(*text) && (digits < 5); digits++)
+  {
+    *value = *value * 10 + (*text++ - '0');
+  }
+  return isdigit(*text) ? 0 : text;
+}
+
+// A minute or hour of a schedule entry, SCHEDULE_ANY for a *
+static const char *parseScheduleField(const char *text, byte *value)
+{
+  unsigned number;
+  if(*text == '*')
+  {
+    *value = SCHEDULE_ANY;
+    return text + 1;
+  }
+  text = parseNumber(text, &number);
+  *value = (number < SCHEDULE_ANY) ? number : SCHEDULE_ANY - 1;
+  return text;
+}
+
+/*
+ Read a schedule entry, in one of these forms (times in UTC):
+   H15 at *:15             every hour at 15 minutes past
+   H00 at 06:00 Mo,We,Fr   at 6 o'clock on some days of the week (Su Mo Tu We Th Fr Sa)
+   H30 every 90 +30        every 90 minutes, 30 minutes after every multiple of 90 minutes since 1970
+   H45 on 2026-10-17 12:00 once
+ Returns false if the text is not understood, or the entry is not valid.
+*/
+static bool parseScheduleEntry(const char *text, ScheduleEntry *entry)
+{
+  unsigned number;
+  memset(entry, 0, sizeof(*entry));
+  if(((text[0] != 'H') && (text[0] != 'h')) || !(text = parseNumber(text + 1, &number)) || (number % 15) || (number > 45))
+  {
+    return false;
+  }
+  entry->message = BEACON_H00MSG + number / 15;
+  while(*text == ' ')
+  {
+    text++;
+  }
+  if(strncasecmp(text, "at ", 3) == 0)
+  {
+    entry->type = SCHEDULE_CRON;
+    if(!(text = parseScheduleField(text + 3, &entry->cron.hour)) || (*text != ':') ||
+       !(text = parseScheduleField(text + 1, &entry->cron.minute)))
+    {
+      return false;
+    }
+    while(*text == ' ')
+    {
+      text++;
+    }
+    entry->cron.days = *text ? 0 : SCHEDULE_ALL_DAYS;
+    while(*text)
+    {
+      const char *day = 0;
+      for(byte i = 0; (i < 7) && !day; i++)
+      {
+        if(strncasecmp(text, &dayNames[2 * i], 2) == 0)
+        {
+          day = text;
+          entry->cron.days |= 1 << i;
+        }
+      }
+      if(!day)
+      {
+        return false;
+      }
+      text += 2;
+      if((*text == ',') || (*text == ' '))
+      {
+        text++;
+      }
+    }
+  }
+  else if(strncasecmp(text, "every ", 6) == 0)
+  {
+    entry->type = SCHEDULE_INTERVAL;
+    if(!(text = parseNumber(text + 6, &number)))
+    {
+      return false;
+    }
+    entry->interval.period = number;
+    while(*text == ' ')
+    {
+      text++;
+    }
+    if(*text == '+')
+    {
+      if(!(text = parseNumber(text + 1, &number)))
+      {
+        return false;
+      }
+      entry->interval.offset = number;
+    }
+    if(*text)
+    {
+      return false;
+    }
+  }
+  else if(strncasecmp(text, "on ", 3) == 0)
+  {
+    unsigned y, mo, d, h, mi;
+    entry->type = SCHEDULE_ONCE;
+    if(!(text = parseNumber(text + 3, &y)) || (*text != '-') || !(text = parseNumber(text + 1, &mo)) || (*text != '-') ||
+       !(text = parseNumber(text + 1, &d)) || (*text != ' ') || !(text = parseNumber(text + 1, &h)) || (*text != ':') ||
+       !(text = parseNumber(text + 1, &mi)) || *text || (y < 1970) || (y > 2105) || (mo < 1) || (mo > 12) ||
+       (d < 1) || (d > 31) || (h > 23) || (mi > 59))
+    {
+      return false;
+    }
+    tmElements_t tm;
+    tm.Year = CalendarYrToTm(y);
+    tm.Month = mo;
+    tm.Day = d;
+    tm.Hour = h;
+    tm.Minute = mi;
+    tm.Second = 0;
+    entry->at = makeTime(tm);
+  }
+  else
+  {
+    return false;
+  }
+  return scheduleValid(*entry);
+}
+
+// Write a schedule entry as read by parseScheduleEntry()
+static void formatScheduleEntry(char *dest, const ScheduleEntry &entry)
+{
+  char hh[3] = "*";
+  char mm[3] = "*";
+  dest += sprintf_P(dest, PSTR("H%02d "), 15 * entry.message);
+  switch(entry.type)
+  {
+    case SCHEDULE_CRON:
+      if(entry.cron.hour != SCHEDULE_ANY)
+      {
+        sprintf_P(hh, PSTR("%02d"), entry.cron.hour);
+      }
+      if(entry.cron.minute != SCHEDULE_ANY)
+      {
+        sprintf_P(mm, PSTR("%02d"), entry.cron.minute);
+      }
+      dest += sprintf_P(dest, PSTR("at %s:%s"), hh, mm);
+      for(byte i = 0; (i < 7) && (entry.cron.days != SCHEDULE_ALL_DAYS); i++)
+      {
+        if(entry.cron.days & (1 << i))
+        {
+          *dest++ = (entry.cron.days & ((1 << i) - 1)) ? ',' : ' ';
+          *dest++ = dayNames[2 * i];
+          *dest++ = dayNames[2 * i + 1];
+        }
+      }
+      *dest = 0;
+      break;
+    case SCHEDULE_INTERVAL:
+      sprintf_P(dest, PSTR("every %u +%u"), entry.interval.period, entry.interval.offset);
+      break;
+    case SCHEDULE_ONCE:
+      sprintf_P(dest, PSTR("on %04d-%02d-%02d %02d:%02d"), year(entry.at), month(entry.at), day(entry.at),
+                hour(entry.at), minute(entry.at));
+      break;
+  }
+}
+
+static const char *const messageNames[] = {"H00", "H15", "H30", "H45", "DEF"};
+
+/*
+ The settings of all beacons as one JSON document, one object per beacon:
+ {"beacons":[{"running":true,"wpm":12,
+              "messages":{"H00":{"text":"...","enabled":true},"H15":{...},"H30":{...},"H45":{...},"DEF":{...}},
+              "schedule":["H00 at *:00","H30 every 90 +30"]},...]}
+ A default message that is too long for the document has "long":true instead of its text.
+ In a POSTed document, a missing member or null leaves the setting as it is, and so does null for a beacon.
+ All changes are checked first, then made at once. The answer is {"ok":true} or {"ok":false,"error":"..."}.
+*/
+static bool sendConfigJSON(EthernetClient &client)
+{
+  char frame_buf[BEACON_MESSAGE_LENGTH + 20];
+  ScheduleEntry entries[SCHEDULE_BEACON_ENTRIES];
+  sendDynamicHeader(frame_buf, client, "application/json");
+  client.print(F("{\"beacons\":["));
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    sprintf_P(frame_buf, PSTR("%s{\"running\":%s,\"wpm\":%u,\"messages\":{"), (i>0) ? "," : "",
+              isBeaconRunning(i) ? "true" : "false", getBeaconSpeed(i));
+    client.print(frame_buf);
+    for(int j=0; j<=BEACON_DEFMSG; j++)
+    {
+      sprintf_P(frame_buf, PSTR("%s\"%s\":{"), (j>0) ? "," : "", messageNames[j]);
+      client.print(frame_buf);
+      if(isBeaconMessageLong(i, j))
+      {
+        client.print(F("\"long\":true"));
+      }
+      else
+      {
+        client.print(F("\"text\":"));
+        getBeaconMessage(i, j, frame_buf, BEACON_MESSAGE_LENGTH);
+        jsonPrintString(client, frame_buf);
+      }
+      client.print(isBeaconMessageEnabled(i, j) ? F(",\"enabled\":true}") : F(",\"enabled\":false}"));
+    }
+    client.print(F("},\"schedule\":["));
+    byte count = getBeaconSchedule(i, entries, SCHEDULE_BEACON_ENTRIES);
+    for(byte k=0; k<count; k++)
+    {
+      if(k>0)
+      {
+        client.print(',');
+      }
+      formatScheduleEntry(frame_buf, entries[k]);
+      jsonPrintString(client, frame_buf);
+    }
+    client.print(F("]}"));
+  }
+  client.print(F("]}"));
+  return false;
+}
+
+// State of reading a POSTed configuration document
+struct ConfigReader
+{
+  JsonReader json;
+  char text[BEACON_MESSAGE_LENGTH];
+  char where[20];                          // the part of the document being read, for the error message
+  bool dryrun;                             // only check the document
+  byte scheduleCount[BEACON_COUNT];        // the schedules would fit together
+};
+
+static bool readFailed(ConfigReader &c)
+{
+  return jsonFail(c.json, F("can not write the SD card"));
+}
+
+static bool readBool(ConfigReader &c, char token, bool *value)
+{
+  if((token != JSON_TRUE) && (token != JSON_FALSE))
+  {
+    return jsonFail(c.json, F("expected true or false"));
+  }
+  *value = (token == JSON_TRUE);
+  return true;
+}
+
+// A text has to be short enough for the record, and the beacon has to be able to send it
+static bool checkText(ConfigReader &c)
+{
+  byte encoded[BEACON_MESSAGE_LENGTH];
+  byte segments[BEACON_PART_SEGMENTS];
+  MorseCompiler compiler;
+  if(strlen(c.text) >= BEACON_MESSAGE_LENGTH)
+  {
+    return jsonFail(c.json, F("text too long"));
+  }
+  if(!morseEncodeMessage(encoded, c.text, BEACON_MESSAGE_LENGTH))
+  {
+    return jsonFail(c.json, F("text can not be sent"));
+  }
+  // Compiled in parts as the scheduler does, so it needs little stack
+  morseCompileStart(compiler, encoded, 0, true);
+  while(!compiler.done)
+  {
+    if(!morseCompileNext(compiler, segments, BEACON_PART_SEGMENTS))
+    {
+      return jsonFail(c.json, F("text can not be sent"));
+    }
+  }
+  return true;
+}
+
+static bool readMessage(ConfigReader &c, int beacon_nr, int msg_index)
+{
+  bool first = true;
+  bool enabled;
+  char token = jsonToken(c.json);
+  if(token == JSON_NULL)
+  {
+    return true;
+  }
+  if(token != '{')
+  {
+    return jsonFail(c.json, F("expected a message object"));
+  }
+  while(jsonMember(c.json, first))
+  {
+    if(strcmp_P(c.text, PSTR("text")) == 0)
+    {
+      token = jsonToken(c.json);
+      if(token == JSON_NULL)
+      {
+        continue;
+      }
+      if(token != JSON_STRING)
+      {
+        return jsonFail(c.json, F("expected a text"));
+      }
+      if(!checkText(c))
+      {
+        return false;
+      }
+      if(!c.dryrun && !configBatchMessage(beacon_nr, msg_index, c.text))
+      {
+        return readFailed(c);
+      }
+    }
+    else if(strcmp_P(c.text, PSTR("enabled")) == 0)
+    {
+      token = jsonToken(c.json);
+      if(token == JSON_NULL)
+      {
+        continue;
+      }
+      if(!readBool(c, token, &enabled))
+      {
+        return false;
+      }
+      if(!c.dryrun && !configBatchEnabled(beacon_nr, msg_index, enabled))
+      {
+        return readFailed(c);
+      }
+    }
+    else
+    {
+      return jsonFail(c.json, F("unknown setting"));
+    }
+  }
+  return !c.json.error;
+}
+
+static bool readMessages(ConfigReader &c, int beacon_nr)
+{
+  bool first = true;
+  while(jsonMember(c.json, first))
+  {
+    int msg_index;
+    for(msg_index=0; (msg_index<=BEACON_DEFMSG) && (strcmp(c.text, messageNames[msg_index]) != 0); msg_index++)
+    {
+    }
+    if(msg_index > BEACON_DEFMSG)
+    {
+      return jsonFail(c.json, F("unknown message"));
+    }
+    sprintf_P(c.where, PSTR("beacon %d %s"), beacon_nr, messageNames[msg_index]);
+    if(!readMessage(c, beacon_nr, msg_index))
+    {
+      return false;
+    }
+  }
+  sprintf_P(c.where, PSTR("beacon %d"), beacon_nr);
+  return !c.json.error;
+}
+
+static bool readSchedule(ConfigReader &c, int beacon_nr)
+{
+  bool first = true;
+  char token;
+  byte count = 0;
+  ScheduleEntry entry;
+  strcat_P(c.where, PSTR(" schedule"));
+  while(jsonItem(c.json, first, &token))
+  {
+    if(token != JSON_STRING)
+    {
+      return jsonFail(c.json, F("expected a schedule entry"));
+    }
+    if(count == SCHEDULE_BEACON_ENTRIES)
+    {
+      return jsonFail(c.json, F("too many entries"));
+    }
+    if(!parseScheduleEntry(c.text, &entry))
+    {
+      return jsonFail(c.json, F("not a valid entry"));
+    }
+    if(!c.dryrun && !configBatchScheduleEntry(beacon_nr, count, entry))
+    {
+      return readFailed(c);
+    }
+    count++;
+  }
+  if(c.json.error)
+  {
+    return false;
+  }
+  if(!c.dryrun && !configBatchScheduleLength(beacon_nr, count))
+  {
+    return readFailed(c);
+  }
+  c.scheduleCount[beacon_nr] = count;
+  sprintf_P(c.where, PSTR("beacon %d"), beacon_nr);
+  return true;
+}
+
+static bool readBeacon(ConfigReader &c, int beacon_nr, char token)
+{
+  bool first = true;
+  bool running;
+  if(token == JSON_NULL)
+  {
+    return true;
+  }
+  if(token != '{')
+  {
+    return jsonFail(c.json, F("expected a beacon object"));
+  }
+  while(jsonMember(c.json, first))
+  {
+    token = jsonToken(c.json);
+    if(token == JSON_NULL)
+    {
+      continue;
+    }
+    if(strcmp_P(c.text, PSTR("running")) == 0)
+    {
+      if(!readBool(c, token, &running))
+      {
+        return false;
+      }
+      if(!c.dryrun && !configBatchRunning(beacon_nr, running))
+      {
+        return readFailed(c);
+      }
+    }
+    else if(strcmp_P(c.text, PSTR("wpm")) == 0)
+    {
+      if((token != JSON_NUMBER) || (c.json.number < BEACON_MIN_WPM) || (c.json.number > BEACON_MAX_WPM))
+      {
+        return jsonFail(c.json, F("wpm out of range"));
+      }
+      if(!c.dryrun && !configBatchSpeed(beacon_nr, c.json.number))
+      {
+        return readFailed(c);
+      }
+    }
+    else if(strcmp_P(c.text, PSTR("messages")) == 0)
+    {
+      if(token != '{')
+      {
+        return jsonFail(c.json, F("expected an object of messages"));
+      }
+      if(!readMessages(c, beacon_nr))
+      {
+        return false;
+      }
+    }
+    else if(strcmp_P(c.text, PSTR("schedule")) == 0)
+    {
+      if(token != '[')
+      {
+        return jsonFail(c.json, F("expected a list of entries"));
+      }
+      if(!readSchedule(c, beacon_nr))
+      {
+        return false;
+      }
+    }
+    else
+    {
+      return jsonFail(c.json, F("unknown setting"));
+    }
+  }
+  return !c.json.error;
+}
+
+static bool readConfig(ConfigReader &c)
+{
+  bool first = true;
+  bool firstBeacon;
+  char token;
+  int beacon_nr;
+  unsigned entries = 0;
+  if(jsonToken(c.json) != '{')
+  {
+    return jsonFail(c.json, F("expected an object"));
+  }
+  while(jsonMember(c.json, first))
+  {
+    if((strcmp_P(c.text, PSTR("beacons")) != 0) || (jsonToken(c.json) != '['))
+    {
+      return jsonFail(c.json, F("expected \"beacons\":["));
+    }
+    firstBeacon = true;
+    for(beacon_nr=0; jsonItem(c.json, firstBeacon, &token); beacon_nr++)
+    {
+      if(beacon_nr == BEACON_COUNT)
+      {
+        c.where[0] = 0;
+        return jsonFail(c.json, F("too many beacons"));
+      }
+      sprintf_P(c.where, PSTR("beacon %d"), beacon_nr);
+      if(!readBeacon(c, beacon_nr, token))
+      {
+        return false;
+      }
+    }
+  }
+  c.where[0] = 0;
+  if(!jsonEnd(c.json))
+  {
+    return false;
+  }
+  for(beacon_nr=0; beacon_nr<BEACON_COUNT; beacon_nr++)
+  {
+    entries += c.scheduleCount[beacon_nr];
+  }
+  if(entries > SCHEDULE_ENTRIES)
+  {
+    return jsonFail(c.json, F("the schedules do not fit together"));
+  }
+  return true;
+}
+
+// Read a POSTed configuration document, and change the settings unless dryrun
+static bool receiveConfigJSON(EthernetClient &client, bool dryrun)
+{
+  ConfigReader c;
+  char frame_buf[80];
+  c.where[0] = 0;
+  c.dryrun = dryrun;
+  for(int i=0; i<BEACON_COUNT; i++)
+  {
+    c.scheduleCount[i] = schedulerEntryCount(i);
+  }
+  jsonBegin(c.json, client, HTTP_req_content_length, c.text, sizeof(c.text));
+  if(!dryrun && !configBatchBegin())
+  {
+    readFailed(c);
+  }
+  else if(readConfig(c) && !dryrun && !configBatchCommit())
+  {
+    readFailed(c);
+  }
+  if(!dryrun && c.json.error)
+  {
+    configBatchAbort();
+  }
+  sendDynamicHeader(frame_buf, client, "application/json");
+  if(!c.json.error)
+  {
+    client.print(F("{\"ok\":true}"));
+  }
+  else
+  {
+    client.print(F("{\"ok\":false,\"error\":\""));
+    if(c.where[0])
+    {
+      client.print(c.where);
+      client.print(F(": "));
+    }
+    client.print(c.json.error);
+    client.print(F("\"}"));
+  }
+  return false;
+}
+
+static bool processConfigJSON(EthernetClient &client)
+{
+  return HTTP_is_post_request ? receiveConfigJSON(client, false) : sendConfigJSON(client);
+}
+
+static bool checkConfigJSON(EthernetClient &client)
+{
+  return HTTP_is_post_request ? receiveConfigJSON(client, true) : send404NotFound(client, HTTP_req_filename);
+}
+
 // WIP
 // TODO: Make messages enable setting in controller
 // TODO: urldecode & verify incoming data.
@@ -532,6 +1248,23 @@ static void parsePostParam(char *text, int beacon_nr, BeaconSettings *settings)
       // new beacon text
     }
   }
+  else if(strncasecmp(text, "wpm=", 4) == 0)
+  {
+    // Anything out of range, even out of the range of an int, is rejected by processPostRequest()
+    long wpm = strtol(text+4, NULL, 10);
+    settings->wpm = ((wpm < 0) || (wpm > BEACON_MAX_WPM)) ? 0 : wpm;
+  }
+  else if(strncasecmp(text, "sched=", 6) == 0)
+  {
+    if(strlen(text+6) < SCHEDULE_TEXT_LENGTH)
+    {
+      urldecode2(settings->sched, text+6);
+    }
+  }
+  else if(strncasecmp(text, "unsched=", 8) == 0)
+  {
+    settings->unsched = atoi(text+8);
+  }
   else if(strncasecmp(text, "textid=", 7) == 0)
   {
     if(strncasecmp(text+7, "def", 3)==0)
@@ -569,7 +1302,54 @@ static void sendMessageForm(char *frame_buf, EthernetClient &client, const char
   client.write(frame_buf, strlen(frame_buf));
 }
 
-static void sendBeaconSettingsPage(char *frame_buf, EthernetClient &client, int beacon_nr)
+static void sendSpeedForm(char *frame_buf, EthernetClient &client, int wpm, bool rejected)
+{
+  sprintf_P(frame_buf, PSTR("<form action=\"index.htm\" method=\"POST\"><fieldset><legend>Speed:</legend>\r\n"));
+  client.write(frame_buf, strlen(frame_buf));
+  if(rejected)
+  {
+    sprintf_P(frame_buf, PSTR("<b>The speed has to be %d to %d WPM</b><br/>\r\n"), BEACON_MIN_WPM, BEACON_MAX_WPM);
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  sprintf_P(frame_buf, PSTR("<input type=\"number\" name=\"wpm\" min=\"%d\" max=\"%d\" value=\"%d\"> WPM\r\n"), BEACON_MIN_WPM, BEACON_MAX_WPM, wpm);
+  client.write(frame_buf, strlen(frame_buf));
+  sprintf_P(frame_buf, PSTR("<input type=\"submit\" value=\"Update\"></fieldset></form>\r\n"));
+  client.write(frame_buf, strlen(frame_buf));
+}
+
+static void sendScheduleForm(char *frame_buf, EthernetClient &client, int beacon_nr, bool rejected)
+{
+  ScheduleEntry entries[SCHEDULE_BEACON_ENTRIES];
+  char text[SCHEDULE_TEXT_LENGTH];
+  byte count = getBeaconSchedule(beacon_nr, entries, SCHEDULE_BEACON_ENTRIES);
+  sprintf_P(frame_buf, PSTR("<fieldset><legend>Schedule of the messages (UTC):</legend>\r\n"));
+  client.write(frame_buf, strlen(frame_buf));
+  for(byte i = 0; i < count; i++)
+  {
+    formatScheduleEntry(text, entries[i]);
+    sprintf_P(frame_buf, PSTR("<form action=\"index.htm\" method=\"POST\"><input type=\"hidden\" name=\"unsched\" value=\"%d\">"
+                              "<input type=\"submit\" value=\"Remove\"> %s</form>\r\n"), i, text);
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  uint32_t next = schedulerNextEvent(beacon_nr);
+  if(next != SCHEDULE_NEVER)
+  {
+    sprintf_P(frame_buf, PSTR("Next event: %04d-%02d-%02d %02d:%02d<br/>\r\n"), year(next), month(next), day(next), hour(next), minute(next));
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  if(rejected)
+  {
+    sprintf_P(frame_buf, PSTR("<b>The entry was not added</b><br/>\r\n"));
+    client.write(frame_buf, strlen(frame_buf));
+  }
+  sprintf_P(frame_buf, PSTR("<form action=\"index.htm\" method=\"POST\"><input type=\"text\" name=\"sched\" placeholder=\"H15 at *:15\">"
+                            "<input type=\"submit\" value=\"Add\"><br/>\r\n"));
+  client.write(frame_buf, strlen(frame_buf));
+  sprintf_P(frame_buf, PSTR("H00 at 06:00 Mo,We,Fr &nbsp; H15 every 60 +15 &nbsp; H30 on 2026-10-17 12:00</form></fieldset>\r\n"));
+  client.write(frame_buf, strlen(frame_buf));
+}
+
+static void sendBeaconSettingsPage(char *frame_buf, EthernetClient &client, int beacon_nr, bool badSpeed, bool rejected)
 {
   char beacon_text[BEACON_MESSAGE_LENGTH];
   sendDynamicHeader(frame_buf, client, "text/html");
@@ -578,21 +1358,25 @@ static void sendBeaconSettingsPage(char *frame_buf, EthernetClient &client, int
   client.write(pre, strlen(pre));
   sprintf(frame_buf, "<h1>beacon number %d <a href=\"index.htm\">(refresh page)</a></h1>", beacon_nr);
   client.write(frame_buf, strlen(frame_buf));
+
+  sendSpeedForm(frame_buf, client, getBeaconSpeed(beacon_nr), badSpeed);
   
   getBeaconMessage(beacon_nr, BEACON_DEFMSG, beacon_text, BEACON_MESSAGE_LENGTH);
   sendMessageForm(frame_buf, client, "def", "Default text", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_DEFMSG));
 
   getBeaconMessage(beacon_nr, BEACON_H00MSG, beacon_text, BEACON_MESSAGE_LENGTH);
-  sendMessageForm(frame_buf, client, "H00", "Message at hh:00", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H00MSG));
+  sendMessageForm(frame_buf, client, "H00", "Message H00", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H00MSG));
 
   getBeaconMessage(beacon_nr, BEACON_H15MSG, beacon_text, BEACON_MESSAGE_LENGTH);
-  sendMessageForm(frame_buf, client, "H15", "Message at hh:15", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H15MSG));
+  sendMessageForm(frame_buf, client, "H15", "Message H15", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H15MSG));
   
   getBeaconMessage(beacon_nr, BEACON_H30MSG, beacon_text, BEACON_MESSAGE_LENGTH);
-  sendMessageForm(frame_buf, client, "H30", "Message at hh:30", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H00MSG));
+  sendMessageForm(frame_buf, client, "H30", "Message H30", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H30MSG));
 
   getBeaconMessage(beacon_nr, BEACON_H45MSG, beacon_text, BEACON_MESSAGE_LENGTH);
-  sendMessageForm(frame_buf, client, "H45", "Message at hh:45", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H00MSG));
+  sendMessageForm(frame_buf, client, "H45", "Message H45", beacon_text, isBeaconMessageEnabled(beacon_nr, BEACON_H45MSG));
+
+  sendScheduleForm(frame_buf, client, beacon_nr, rejected);
 
   client.write(post, strlen(post));
 }
@@ -605,6 +1389,11 @@ static bool processPostRequest(EthernetClient &client, int beacon_nr)
   settings.enabled = false;
   settings.text[0] = 0;
   settings.textid = -1;
+  settings.wpm = -1;
+  settings.sched[0] = 0;
+  settings.unsched = -1;
+  bool badSpeed = false;
+  bool rejected = false;
   char new_msg[BEACON_MESSAGE_LENGTH];
   Serial.print("content-length ");
   Serial.print(HTTP_req_content_length);
@@ -633,8 +1422,33 @@ static bool processPostRequest(EthernetClient &client, int beacon_nr)
     setBeaconMessage(beacon_nr, settings.textid, settings.text);
     setBeaconMessageEnabled(beacon_nr, settings.textid, settings.enabled);
   }
+  if(settings.wpm >= 0)
+  {
+    // setBeaconSpeed() takes a byte, check before it is cut off
+    badSpeed = (settings.wpm < BEACON_MIN_WPM) || (settings.wpm > BEACON_MAX_WPM);
+    if(!badSpeed)
+    {
+      setBeaconSpeed(beacon_nr, settings.wpm);
+    }
+  }
+  if(settings.sched[0] || (settings.unsched >= 0))
+  {
+    ScheduleEntry entries[SCHEDULE_BEACON_ENTRIES];
+    byte count = getBeaconSchedule(beacon_nr, entries, SCHEDULE_BEACON_ENTRIES);
+    if((settings.unsched >= 0) && (settings.unsched < count))
+    {
+      count--;
+      memmove(&entries[settings.unsched], &entries[settings.unsched + 1], (count - settings.unsched) * sizeof(ScheduleEntry));
+    }
+    if(settings.sched[0])
+    {
+      rejected = (count == SCHEDULE_BEACON_ENTRIES) || !parseScheduleEntry(settings.sched, &entries[count]);
+      count += rejected ? 0 : 1;
+    }
+    rejected = !setBeaconSchedule(beacon_nr, entries, count) || rejected;
+  }
   // The POST request has been parsed. Let's do a sanity check, update the configuration and send back the page.
-  sendBeaconSettingsPage(frame_buf, client, beacon_nr);
+  sendBeaconSettingsPage(frame_buf, client, beacon_nr, badSpeed, rejected);
   return false;
 }
 
@@ -664,21 +1478,26 @@ static bool httpRespond(EthernetClient &client)
   Serial.println(HTTP_req_filename);
   if(1)
   {
+    char *beacon_path = HTTP_req_filename+1;
+    long beacon_nr = -1;
     if( (HTTP_req_filename[0]=='/') &&
-        isdigit(HTTP_req_filename[1]) &&
-        (HTTP_req_filename[2]=='/') )
+        isdigit(HTTP_req_filename[1]) )
+    {
+      beacon_nr = strtol(HTTP_req_filename+1, &beacon_path, 10);
+    }
+    if( (beacon_nr >= 0) && (*beacon_path=='/') )
     {
       BeaconPage *page;
       for(page=beaconpages; page->filename; page++)
       {
-        if(strcasecmp(page->filename, HTTP_req_filename+2)==0)
+        if(strcasecmp(page->filename, beacon_path)==0)
         {
           break;
         }
       }
-      if(page->handler)
+      if(page->handler && (beacon_nr < BEACON_COUNT))
       {
-        return page->handler(client, HTTP_req_filename[1]-'0');
+        return page->handler(client, beacon_nr);
       }
       else
       {
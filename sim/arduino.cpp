@@ -0,0 +1,83 @@
+// Host implementation of the stub Arduino core
+#include <Arduino.h>
+#include <TimeLib.h>
+
+volatile uint16_t TCNT1;
+volatile uint16_t OCR1A;
+volatile uint8_t TIMSK1;
+volatile uint8_t SREG;
+
+SimSerial Serial;
+
+// Pins are spread over 8 bit ports in order, like most of the pins of the Mega
+#define SIM_PORTS 16
+static volatile uint8_t ports[SIM_PORTS + 1];
+
+void pinMode(uint8_t, uint8_t)
+{
+}
+
+uint8_t digitalPinToPort(uint8_t pin)
+{
+  return (pin / 8 < SIM_PORTS) ? pin / 8 + 1 : NOT_A_PORT;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin)
+{
+  return 1 << (pin % 8);
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port)
+{
+  return &ports[port];
+}
+
+int simPinLevel(uint8_t pin)
+{
+  return (ports[digitalPinToPort(pin)] & digitalPinToBitMask(pin)) ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+  return simPinLevel(pin);
+}
+
+int analogRead(uint8_t)
+{
+  return 0;
+}
+
+static unsigned long simMillis;
+
+unsigned long millis()
+{
+  return simMillis;
+}
+
+void simSetMillis(unsigned long ms)
+{
+  simMillis = ms;
+}
+
+void delay(unsigned long)
+{
+}
+
+static time_t simTime;
+static bool simTimeSet;
+
+time_t now()
+{
+  return simTime;
+}
+
+void setTime(time_t t)
+{
+  simTime = t;
+  simTimeSet = true;
+}
+
+timeStatus_t timeStatus()
+{
+  return simTimeSet ? timeSet : timeNotSet;
+}
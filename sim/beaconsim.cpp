@@ -0,0 +1,474 @@
+// Host-side simulator of the beacon engine.
+// Runs the beacon interrupt and the scheduler on a virtual clock, records the pins of all beacons
+// as a VCD file and checks the keying against the 50 dot per word definition. See sim/README.md.
+#include <Arduino.h>
+#include <TimeLib.h>
+#include <time.h>
+#include <unistd.h>
+#include "BeaconController.h"
+#include "ControlPanel.h"
+#include "Scheduler.h"
+#include "Monitor.h"
+
+// The main loop runs every 20ms, as in Beacon.ino
+#define LOOP_TICKS (BEACON_TICK_RATE / 50)
+// Start of the simulation, a few minutes before the hour so the slot messages show up
+#define SIM_START_TIME 1500001020UL
+
+Beacon beacons[BEACON_COUNT];
+
+// Same pins as Beacon.ino (normal/inverted/PM0/PM1)
+static const byte beaconPins[BEACON_COUNT][4] =
+{
+  {9,8,7,6},
+  {22,23,24,25},
+  {26,27,28,29},
+  {30,31,32,33},
+  {34,35,36,37},
+  {38,39,40,41},
+  {42,43,44,45},
+  {46,47,48,49},
+  {14,15,16,17}
+};
+
+/********************************************************************************************************\
+|***                                     Control panel and sensors                                    ***|
+\********************************************************************************************************/
+
+static const char *messageTexts[BEACON_DEFMSG+1];
+static byte encodedMessages[BEACON_COUNT][BEACON_DEFMSG+1][BEACON_MESSAGE_LENGTH];
+static bool encoded[BEACON_COUNT][BEACON_DEFMSG+1];
+static int activeBeacons = BEACON_COUNT;
+
+// Like the control panel, a default message that does not fit in BEACON_MESSAGE_LENGTH is streamed
+bool isBeaconMessageStreamed(int beacon_nr, int msg_index)
+{
+  return (beacon_nr < activeBeacons) && (msg_index == BEACON_DEFMSG) && messageTexts[msg_index] &&
+         (strlen(messageTexts[msg_index]) >= BEACON_MESSAGE_LENGTH);
+}
+
+bool readBeaconMessage(int beacon_nr, int msg_index, unsigned long *pos, char *dest, int bufsz)
+{
+  const char *text = messageTexts[msg_index];
+  unsigned long size = strlen(text);
+  int len = 0;
+  while((len < bufsz - 1) && (*pos < size))
+  {
+    char c = text[*pos];
+    if((c == '$') && (len > bufsz - 5))
+    {
+      break;
+    }
+    (*pos)++;
+    if(c == '\r')
+    {
+      continue;
+    }
+    dest[len++] = (c == '\n') ? ' ' : c;
+  }
+  dest[len] = 0;
+  return *pos < size;
+}
+
+const byte *getEncodedBeaconMessage(int beacon_nr, int msg_index)
+{
+  if((beacon_nr >= activeBeacons) || !messageTexts[msg_index] || !messageTexts[msg_index][0] ||
+     isBeaconMessageStreamed(beacon_nr, msg_index))
+  {
+    return 0;
+  }
+  if(!encoded[beacon_nr][msg_index])
+  {
+    if(!morseEncodeMessage(encodedMessages[beacon_nr][msg_index], messageTexts[msg_index], BEACON_MESSAGE_LENGTH))
+    {
+      fprintf(stderr, "Can not encode \"%s\": %s\n", messageTexts[msg_index], morseGetError());
+      exit(2);
+    }
+    encoded[beacon_nr][msg_index] = true;
+  }
+  return encodedMessages[beacon_nr][msg_index];
+}
+
+bool isBeaconMessageSending(int beacon_nr, int msg_index)
+{
+  return (beacon_nr < activeBeacons) && messageTexts[msg_index] && messageTexts[msg_index][0];
+}
+
+bool prepareBeaconMessage(int beacon_nr, int msg_index)
+{
+  getEncodedBeaconMessage(beacon_nr, msg_index);
+  return true;
+}
+
+// No PWM timers in the simulator, all beacons use hard keying
+byte shapingAttachPin(int pin)
+{
+  return SHAPING_NONE;
+}
+
+void shapingKey(byte channel, boolean on)
+{
+}
+
+// No ADC either, the power detectors are not sampled
+void keyedAdcKey(byte channel, boolean on)
+{
+}
+
+int keyedAdcAnalogRead(byte input)
+{
+  return analogRead(input);
+}
+
+// Sensor values are fixed, so the output is the same every run
+
+const byte *sensorMorse(byte sensor)
+{
+  static byte values[2][SENSOR_MORSE_LENGTH];
+  static bool done;
+  if(!done)
+  {
+    morseEncodeMessage(values[0], "2V5", SENSOR_MORSE_LENGTH);
+    morseEncodeMessage(values[1], "21C", SENSOR_MORSE_LENGTH);
+    done = true;
+  }
+  return values[(sensor < NUM_ANALOG_CHANNELS) ? 0 : 1];
+}
+
+/********************************************************************************************************\
+|***                                          Timing summary                                          ***|
+\********************************************************************************************************/
+
+// Runs of equal key state, in dots. Anything longer than a word gap is a $+n/$-n delay.
+#define RUN_KEY_ON   0
+#define RUN_KEY_OFF  1
+#define MAX_RUN_DOTS 8
+
+struct RunStats
+{
+  unsigned long count;
+  unsigned long minTicks;
+  unsigned long maxTicks;
+};
+
+struct BeaconTiming
+{
+  byte wpm;
+  int state;                  // -1 carrier off, otherwise RUN_KEY_ON or RUN_KEY_OFF
+  unsigned long runStart;
+  RunStats runs[2][MAX_RUN_DOTS + 1];  // by state and dots, MAX_RUN_DOTS for delays
+  unsigned long dots;         // keyed time, in dots
+  unsigned long ticks;        // keyed time, in ticks
+  unsigned long words;        // word gaps
+  unsigned long wordDots;     // dots and ticks up to the last word gap
+  unsigned long wordTicks;
+  unsigned long badRuns;      // not a whole number of dots
+  unsigned long carrierOff;   // longest time with the carrier off, in ticks
+};
+
+static BeaconTiming timing[BEACON_COUNT];
+
+static double dotTicks(byte wpm)
+{
+  return 6.0 * BEACON_TICK_RATE / (5.0 * wpm);
+}
+
+static void timingRun(BeaconTiming &t, int state, unsigned long ticks)
+{
+  double exact = ticks / dotTicks(t.wpm);
+  unsigned long dots = (unsigned long)(exact + 0.5);
+  // Every edge is rounded to a whole tick, so a run can be off by less than one tick either way
+  if((dots == 0) || (ticks + 1 <= dots * dotTicks(t.wpm)) || (ticks >= dots * dotTicks(t.wpm) + 1))
+  {
+    t.badRuns++;
+  }
+  if(dots > 7)
+  {
+    dots = MAX_RUN_DOTS;
+  }
+  RunStats &r = t.runs[state][dots];
+  if((r.count == 0) || (ticks < r.minTicks))
+  {
+    r.minTicks = ticks;
+  }
+  if(ticks > r.maxTicks)
+  {
+    r.maxTicks = ticks;
+  }
+  r.count++;
+  if(dots < MAX_RUN_DOTS)
+  {
+    // Delays are not part of the words
+    t.dots += dots;
+    t.ticks += ticks;
+    if((state == RUN_KEY_OFF) && (dots == 7))
+    {
+      t.words++;
+      t.wordDots = t.dots;
+      t.wordTicks = t.ticks;
+    }
+  }
+}
+
+static void timingSample(int beacon_nr, unsigned long tick, int key, int inv)
+{
+  BeaconTiming &t = timing[beacon_nr];
+  int state = key ? RUN_KEY_ON : (inv ? RUN_KEY_OFF : -1);
+  if(state != t.state)
+  {
+    if(t.state >= 0)
+    {
+      timingRun(t, t.state, tick - t.runStart);
+    }
+    else if(tick - t.runStart > t.carrierOff)
+    {
+      t.carrierOff = tick - t.runStart;
+    }
+    t.state = state;
+    t.runStart = tick;
+  }
+}
+
+static const char *runName(int state, int dots)
+{
+  if(state == RUN_KEY_ON)
+  {
+    return (dots == 1) ? "dot" : (dots == 3) ? "dash" : (dots == MAX_RUN_DOTS) ? "carrier on delay" : "bad element";
+  }
+  return (dots == 1) ? "element gap" : (dots == 3) ? "character gap" : (dots == 7) ? "word gap" :
+         (dots == MAX_RUN_DOTS) ? "carrier off delay" : "bad gap";
+}
+
+// Print the summary of a beacon, returns false if the timing is wrong
+static bool timingReport(int beacon_nr, unsigned long expectDotsPerWord, unsigned long maxCarrierOff)
+{
+  BeaconTiming &t = timing[beacon_nr];
+  bool ok = (t.badRuns == 0) && (t.words > 0);
+  printf("beacon %d: %d WPM, dot %.3f ticks\n", beacon_nr, t.wpm, dotTicks(t.wpm));
+  for(int state = RUN_KEY_ON; state <= RUN_KEY_OFF; state++)
+  {
+    for(int dots = 1; dots <= MAX_RUN_DOTS; dots++)
+    {
+      RunStats &r = t.runs[state][dots];
+      if(r.count)
+      {
+        printf("  %-18s %6lu x  %lu-%lu ticks\n", runName(state, dots), r.count, r.minTicks, r.maxTicks);
+        if((dots != 1) && (dots != 3) && (dots != MAX_RUN_DOTS) && ((state == RUN_KEY_ON) || (dots != 7)))
+        {
+          ok = false;
+        }
+      }
+    }
+  }
+  if(t.words)
+  {
+    // A word is 50 dots: WPM = 60s / (50 dots * dot length)
+    double wpm = 60.0 * BEACON_TICK_RATE * t.wordDots / (50.0 * t.wordTicks);
+    printf("  measured %.3f WPM, %.2f dots per word\n", wpm, (double)t.wordDots / t.words);
+    if((wpm < t.wpm * 0.995) || (wpm > t.wpm * 1.005))
+    {
+      ok = false;
+    }
+    if(expectDotsPerWord && (t.wordDots != expectDotsPerWord * t.words))
+    {
+      ok = false;
+    }
+  }
+  printf("  carrier off for at most %lu ticks\n", t.carrierOff);
+  if(maxCarrierOff && (t.carrierOff > maxCarrierOff * BEACON_TICK_RATE))
+  {
+    ok = false;
+  }
+  if(t.badRuns)
+  {
+    printf("  %lu runs are not a whole number of dots\n", t.badRuns);
+  }
+  MonitorStatus m;
+  if(monitorGet(beacon_nr, &m))
+  {
+    printf("  decoded %lu words, %lu errors, %lu unchecked, %u WPM: \"%s\"\n", m.words, m.errors, m.unchecked, m.wpm, m.text);
+    if(m.errors || !m.words)
+    {
+      ok = false;
+    }
+  }
+  printf("  %s\n", ok ? "OK" : "FAIL");
+  return ok;
+}
+
+/********************************************************************************************************\
+|***                                            VCD output                                            ***|
+\********************************************************************************************************/
+
+static const char *pinNames[4] = { "key", "inv", "pm0", "pm1" };
+
+static void vcdHeader(FILE *f)
+{
+  fprintf(f, "$date simulated $end\n$version beaconsim $end\n$timescale 1 us $end\n$scope module beacons $end\n");
+  for(int i = 0; i < activeBeacons; i++)
+  {
+    for(int p = 0; p < 4; p++)
+    {
+      fprintf(f, "$var wire 1 %c b%d_%s $end\n", '!' + i * 4 + p, i, pinNames[p]);
+    }
+  }
+  fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+}
+
+/********************************************************************************************************\
+|***                                              Main                                                ***|
+\********************************************************************************************************/
+
+static void usage()
+{
+  fprintf(stderr,
+    "usage: beaconsim [options] [text]\n"
+    "  text      default message of the beacons (\"PARIS \")\n"
+    "  -w list   speeds in WPM, comma separated, assigned to the beacons in turn (12)\n"
+    "  -n count  number of beacons sending (all)\n"
+    "  -s secs   simulated time (60)\n"
+    "  -S text   message at hh:00, hh:15, hh:30 and hh:45\n"
+    "  -o file   write the pins to a VCD file\n"
+    "  -d dots   check that every word is this many dots (50 for PARIS)\n"
+    "  -g secs   check that the carrier is never off for longer\n"
+    "  -m ms     the main loop is busy this long every second, the monitors are not sampled\n"
+    "  -b        benchmark only: do not look at the pins\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  const char *speeds = "12";
+  const char *vcdName = 0;
+  unsigned long seconds = 60;
+  unsigned long expectDotsPerWord = 0;
+  unsigned long maxCarrierOff = 0;
+  unsigned long busyTicks = 0;
+  bool benchmark = false;
+  int opt;
+  while((opt = getopt(argc, argv, "w:n:s:S:o:d:g:m:b")) != -1)
+  {
+    switch(opt)
+    {
+      case 'w': speeds = optarg; break;
+      case 'n': activeBeacons = atoi(optarg); break;
+      case 's': seconds = strtoul(optarg, 0, 10); break;
+      case 'S': messageTexts[BEACON_H00MSG] = messageTexts[BEACON_H15MSG] = messageTexts[BEACON_H30MSG] = messageTexts[BEACON_H45MSG] = optarg; break;
+      case 'o': vcdName = optarg; break;
+      case 'd': expectDotsPerWord = strtoul(optarg, 0, 10); break;
+      case 'g': maxCarrierOff = strtoul(optarg, 0, 10); break;
+      case 'm': busyTicks = strtoul(optarg, 0, 10) * BEACON_TICK_RATE / 1000; break;
+      case 'b': benchmark = true; break;
+      default: usage();
+    }
+  }
+  messageTexts[BEACON_DEFMSG] = (optind < argc) ? argv[optind] : "PARIS ";
+  if((activeBeacons < 1) || (activeBeacons > BEACON_COUNT))
+  {
+    usage();
+  }
+
+  // setup(), without the hardware
+  setTime(SIM_START_TIME);
+  beaconClockSet(SIM_START_TIME);
+  const char *speed = speeds;
+  for(int i = 0; i < BEACON_COUNT; i++)
+  {
+    beacons[i].begin(beaconPins[i][0], beaconPins[i][1], beaconPins[i][2], beaconPins[i][3]);
+    beacons[i].setSpeed(atoi(speed));
+    timing[i].wpm = beacons[i].getSpeed();
+    timing[i].state = -1;
+    speed = strchr(speed, ',') ? strchr(speed, ',') + 1 : speeds;
+  }
+  schedulerInit();
+  TIMSK1 |= (1 << OCIE1A);  // the timer starts
+  // The loopback decoders listen to the normal outputs
+  monitorInit();
+  for(int i = 0; (i < activeBeacons) && !benchmark; i++)
+  {
+    monitorAttach(i, beaconPins[i][0]);
+  }
+
+  FILE *vcd = 0;
+  if(vcdName)
+  {
+    vcd = fopen(vcdName, "w");
+    if(!vcd)
+    {
+      perror(vcdName);
+      return 2;
+    }
+    vcdHeader(vcd);
+  }
+
+  byte levels[BEACON_COUNT][4];
+  memset(levels, 0xFF, sizeof(levels));
+  unsigned long totalTicks = seconds * BEACON_TICK_RATE;
+  unsigned long interrupts = 0;
+  clock_t started = clock();
+  for(unsigned long tick = 1; tick <= totalTicks; tick++)
+  {
+    // Timer1 runs freely, the interrupt always comes right on time
+    TCNT1 = tick * BEACON_TIMER_PERIOD;
+    if(TCNT1 == OCR1A)
+    {
+      beaconInterrupt();
+      interrupts++;
+    }
+    if((tick % LOOP_TICKS) == 0)
+    {
+      setTime(SIM_START_TIME + tick / BEACON_TICK_RATE);
+      schedulerTick();
+    }
+    if(benchmark)
+    {
+      continue;
+    }
+    simSetMillis(tick * 1000 / BEACON_TICK_RATE);
+    if((tick % BEACON_TICK_RATE) >= busyTicks)
+    {
+      monitorTick();
+    }
+    bool stamped = false;
+    for(int i = 0; i < activeBeacons; i++)
+    {
+      for(int p = 0; p < 4; p++)
+      {
+        byte level = simPinLevel(beaconPins[i][p]);
+        if(level != levels[i][p])
+        {
+          levels[i][p] = level;
+          if(vcd)
+          {
+            if(!stamped)
+            {
+              fprintf(vcd, "#%lu\n", tick * (1000000UL / BEACON_TICK_RATE));
+              stamped = true;
+            }
+            fprintf(vcd, "%d%c\n", level, '!' + i * 4 + p);
+          }
+        }
+      }
+      timingSample(i, tick, levels[i][0], levels[i][1]);
+    }
+  }
+  double elapsed = (double)(clock() - started) / CLOCKS_PER_SEC;
+  if(vcd)
+  {
+    fprintf(vcd, "#%lu\n", totalTicks * (1000000UL / BEACON_TICK_RATE));
+    fclose(vcd);
+  }
+
+  bool ok = true;
+  if(!benchmark)
+  {
+    for(int i = 0; i < activeBeacons; i++)
+    {
+      ok = timingReport(i, expectDotsPerWord, maxCarrierOff) && ok;
+    }
+  }
+  printf("%lu ticks of %d beacons in %.3f s: %.0f ticks/s, %.0f beacon ticks/s, %lu interrupts (%.1f%% of the ticks)\n",
+         totalTicks, BEACON_COUNT, elapsed, totalTicks / elapsed, totalTicks * (double)BEACON_COUNT / elapsed,
+         interrupts, 100.0 * interrupts / totalTicks);
+  return ok ? 0 : 1;
+}
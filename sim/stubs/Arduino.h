@@ -0,0 +1,74 @@
+// Minimal Arduino core for building the beacon engine on the host, see sim/README.md
+#ifndef ARDUINO_H_
+#define ARDUINO_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <avr/pgmspace.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define NOT_A_PORT 0
+#define BIN 2
+#define DEC 10
+
+void pinMode(uint8_t pin, uint8_t mode);
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+volatile uint8_t *portOutputRegister(uint8_t port);
+
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t channel);
+unsigned long millis();
+void delay(unsigned long ms);
+
+// Simulated port registers, for reading back the pins
+int simPinLevel(uint8_t pin);
+// Set the time returned by millis()
+void simSetMillis(unsigned long ms);
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+
+// Serial output goes to stderr
+class SimSerial
+{
+  public:
+  void print(const char *s) { fputs(s, stderr); }
+  void print(const __FlashStringHelper *s) { fputs((const char *)s, stderr); }
+  void print(long n) { fprintf(stderr, "%ld", n); }
+  void print(int n) { print((long)n); }
+  void print(long n, int base)
+  {
+    if(base == BIN)
+    {
+      for(int i = 7; i >= 0; i--)
+      {
+        fputc((n >> i) & 1 ? '1' : '0', stderr);
+      }
+    }
+    else
+    {
+      print(n);
+    }
+  }
+  template<class T> void println(T v, int base) { print((long)v, base); fputs("\n", stderr); }
+  template<class T> void println(T v) { print(v); fputs("\n", stderr); }
+};
+extern SimSerial Serial;
+
+#endif
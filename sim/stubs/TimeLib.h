@@ -0,0 +1,12 @@
+#ifndef TIMELIB_H_
+#define TIMELIB_H_
+
+#include <time.h>
+
+enum timeStatus_t { timeNotSet, timeNeedsSync, timeSet };
+
+time_t now();
+void setTime(time_t t);
+timeStatus_t timeStatus();
+
+#endif
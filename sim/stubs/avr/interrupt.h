@@ -0,0 +1,8 @@
+#ifndef INTERRUPT_H_
+#define INTERRUPT_H_
+
+// The simulator calls the interrupt and the main loop one after the other
+#define cli()
+#define sei()
+
+#endif
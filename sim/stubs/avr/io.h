@@ -0,0 +1,14 @@
+#ifndef IO_H_
+#define IO_H_
+
+#include <stdint.h>
+
+// Timer1 registers, driven by the simulator
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint8_t TIMSK1;
+// Status register, saved and restored around cli()
+extern volatile uint8_t SREG;
+#define OCIE1A 1
+
+#endif
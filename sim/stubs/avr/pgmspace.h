@@ -0,0 +1,14 @@
+#ifndef PGMSPACE_H_
+#define PGMSPACE_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define sprintf_P sprintf
+#define strcpy_P strcpy
+
+#endif